@@ -0,0 +1,634 @@
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tml2tty.h"
+
+/* read granularity for streamed records */
+#define BATCH_READ 65536
+/* records handed to a worker at once */
+#define BATCH_JOB_RECORDS 64
+/* input bytes handed to a worker at once */
+#define BATCH_JOB_BYTES 65536
+/* jobs in flight per worker */
+#define BATCH_DEPTH 4
+
+/* job states */
+#define JOB_FREE   0
+#define JOB_QUEUED 1
+#define JOB_DONE   2
+
+/* a run of records rendered by one worker */
+struct batch_job {
+  int state;
+  /* record data, back to back */
+  struct tml_buffer in;
+  size_t *lens;
+  int nrec;
+  int caprec;
+  /* number of the first record */
+  unsigned long first;
+  /* rendered records in output framing */
+  struct tml_buffer out;
+  unsigned long errors;
+};
+
+/* a worker thread with its own processor */
+struct batch_worker {
+  pthread_t thread;
+  struct batch *batch;
+  struct processor proc;
+  struct tml_template *tmpl;
+  /* rendered record */
+  struct tml_buffer tmp;
+  int running;
+};
+
+struct batch {
+  struct processor *proc;
+  struct options *opts;
+  /* record format */
+  int format;
+  /* template and its source, if records are variables */
+  struct tml_template *tmpl;
+  struct tml_buffer tsrc;
+  /* rendered record */
+  struct tml_buffer out;
+  /* records rendered and failed */
+  unsigned long records;
+  unsigned long errors;
+
+  /* worker pool, if any */
+  struct batch_worker *workers;
+  int nworkers;
+  /* ring of jobs */
+  struct batch_job *jobs;
+  int njobs;
+  /* job being filled */
+  struct batch_job *cur;
+  /* jobs queued, taken by workers and written out */
+  unsigned long queued;
+  unsigned long taken;
+  unsigned long drained;
+  int stop;
+  pthread_mutex_t lock;
+  /* signals queued jobs to workers */
+  pthread_cond_t work;
+  /* signals finished jobs to the writer */
+  pthread_cond_t done;
+};
+
+/* append to a growable buffer */
+static void buffer_put(struct tml_buffer *b, const void *data, size_t len)
+{
+  size_t cap;
+  char *n;
+
+  if(len == 0) {
+    return;
+  }
+  if(b->len + len > b->cap) {
+    cap = 2 * (b->cap + len);
+    n = realloc(b->data, cap);
+    if(!n) {
+      abort();
+    }
+    b->data = n;
+    b->cap = cap;
+  }
+  memcpy(b->data + b->len, data, len);
+  b->len += len;
+}
+
+/* set variables from the name=value lines of a record */
+static int batch_vars(struct batch *b, struct processor *proc,
+		      const char *buf, size_t len)
+{
+  const char *e = buf + len, *nl;
+  int i;
+
+  /* definitions from the command line are defaults */
+  processor_clearvars(proc);
+  for(i = 0; i < b->opts->ndefines; i++) {
+    define_var(proc, b->opts->defines[i], strlen(b->opts->defines[i]));
+  }
+
+  while(buf < e) {
+    nl = memchr(buf, '\n', e - buf);
+    if(!nl) {
+      nl = e;
+    }
+    if(nl > buf && define_var(proc, buf, nl - buf)) {
+      return 1;
+    }
+    buf = nl + 1;
+  }
+
+  return 0;
+}
+
+/* render record number N into TMP, returns 1 if it failed */
+static int batch_render(struct batch *b, struct processor *proc,
+			struct tml_template *tmpl, unsigned long n,
+			const char *buf, size_t len, struct tml_buffer *tmp)
+{
+  int res;
+
+  tmp->len = 0;
+  tmp->lost = 0;
+  if(tmpl) {
+    res = batch_vars(b, proc, buf, len);
+    if(!res) {
+      res = processor_render_template(proc, tmpl, tmp);
+    }
+  } else {
+    res = processor_render(proc, buf, len, tmp);
+  }
+  if(res != TML_OK) {
+    fprintf(stderr, "Record %lu failed to render\n", n);
+    /* failed records stay in place, but empty */
+    tmp->len = 0;
+    return 1;
+  }
+  return 0;
+}
+
+/* header of a rendered record in the batch format */
+static int batch_header(int format, size_t len, char *hdr, size_t size)
+{
+  if(format == BATCH_LENGTH) {
+    return snprintf(hdr, size, "%zu\n", len);
+  }
+  return 0;
+}
+
+/* render all records of a job into its output */
+static void batch_job_render(struct batch *b, struct batch_worker *w,
+			     struct batch_job *job)
+{
+  const char *p = job->in.data;
+  char hdr[32];
+  int i, n;
+
+  for(i = 0; i < job->nrec; i++) {
+    job->errors += batch_render(b, &w->proc, w->tmpl, job->first + i,
+				p, job->lens[i], &w->tmp);
+    p += job->lens[i];
+
+    n = batch_header(b->format, w->tmp.len, hdr, sizeof(hdr));
+    buffer_put(&job->out, hdr, n);
+    buffer_put(&job->out, w->tmp.data, w->tmp.len);
+    if(b->format == BATCH_NUL) {
+      buffer_put(&job->out, "", 1);
+    }
+  }
+}
+
+static void *batch_worker(void *arg)
+{
+  struct batch_worker *w = arg;
+  struct batch *b = w->batch;
+  struct batch_job *job;
+
+  pthread_mutex_lock(&b->lock);
+  while(1) {
+    while(!b->stop && b->taken == b->queued) {
+      pthread_cond_wait(&b->work, &b->lock);
+    }
+    if(b->taken == b->queued) {
+      break;
+    }
+    job = &b->jobs[b->taken++ % b->njobs];
+    pthread_mutex_unlock(&b->lock);
+
+    batch_job_render(b, w, job);
+
+    pthread_mutex_lock(&b->lock);
+    job->state = JOB_DONE;
+    pthread_cond_signal(&b->done);
+  }
+  pthread_mutex_unlock(&b->lock);
+
+  return NULL;
+}
+
+/* flush between records, unless the policy coalesces them */
+static void batch_flush(struct batch *b)
+{
+  if(b->proc->flush != FLUSH_SIZE && b->proc->flush != FLUSH_IDLE) {
+    processor_flush(b->proc);
+  }
+}
+
+/* write out finished jobs in order, waiting for them if WAIT is set,
+   until at most LEFT jobs are outstanding */
+static void batch_drain(struct batch *b, unsigned long left, int wait)
+{
+  struct batch_job *job;
+  int state;
+
+  while(b->queued - b->drained > left) {
+    job = &b->jobs[b->drained % b->njobs];
+    pthread_mutex_lock(&b->lock);
+    while(wait && job->state != JOB_DONE) {
+      pthread_cond_wait(&b->done, &b->lock);
+    }
+    state = job->state;
+    pthread_mutex_unlock(&b->lock);
+    if(state != JOB_DONE) {
+      break;
+    }
+
+    processor_write(b->proc, job->out.data, job->out.len);
+    batch_flush(b);
+    b->errors += job->errors;
+
+    job->state = JOB_FREE;
+    b->drained++;
+  }
+}
+
+/* hand the job being filled to the workers */
+static void batch_submit(struct batch *b)
+{
+  if(!b->cur) {
+    return;
+  }
+  pthread_mutex_lock(&b->lock);
+  b->cur->state = JOB_QUEUED;
+  b->queued++;
+  pthread_cond_signal(&b->work);
+  pthread_mutex_unlock(&b->lock);
+  b->cur = NULL;
+}
+
+/* add a record to the job being filled */
+static void batch_queue(struct batch *b, const char *buf, size_t len)
+{
+  struct batch_job *job = b->cur;
+  size_t *n;
+
+  if(!job) {
+    /* write out what is ready, then make room for another job */
+    batch_drain(b, 0, 0);
+    batch_drain(b, b->njobs - 1, 1);
+
+    job = &b->jobs[b->queued % b->njobs];
+    job->in.len = 0;
+    job->out.len = 0;
+    job->nrec = 0;
+    job->errors = 0;
+    job->first = b->records + 1;
+    b->cur = job;
+  }
+
+  if(job->nrec == job->caprec) {
+    n = realloc(job->lens, 2 * (job->caprec + 1) * sizeof(*n));
+    if(!n) {
+      abort();
+    }
+    job->lens = n;
+    job->caprec = 2 * (job->caprec + 1);
+  }
+  buffer_put(&job->in, buf, len);
+  job->lens[job->nrec++] = len;
+  b->records++;
+
+  if(job->nrec >= BATCH_JOB_RECORDS || job->in.len >= BATCH_JOB_BYTES) {
+    batch_submit(b);
+  }
+}
+
+/* render one record and write it out in the batch format */
+static void batch_record(struct batch *b, const char *buf, size_t len)
+{
+  char hdr[32];
+  int n;
+
+  if(b->workers) {
+    batch_queue(b, buf, len);
+    return;
+  }
+
+  b->records++;
+  b->errors += batch_render(b, b->proc, b->tmpl, b->records,
+			    buf, len, &b->out);
+
+  n = batch_header(b->format, b->out.len, hdr, sizeof(hdr));
+  processor_write(b->proc, hdr, n);
+  processor_write(b->proc, b->out.data, b->out.len);
+  if(b->format == BATCH_NUL) {
+    processor_write(b->proc, "", 1);
+  }
+
+  batch_flush(b);
+}
+
+/* render all complete records in BUF, returns the bytes consumed
+   or -1 on malformed input */
+static ssize_t batch_split(struct batch *b,
+			   const char *buf, size_t len, int eof)
+{
+  const char *p = buf, *e = buf + len, *q, *r;
+  size_t n;
+
+  while(p < e) {
+    r = p;
+    if(b->format == BATCH_NUL) {
+      /* records end with a NUL, the last one may not */
+      q = memchr(p, 0, e - p);
+      if(!q) {
+	if(!eof) {
+	  break;
+	}
+	q = e;
+      }
+      batch_record(b, p, q - p);
+      p = (q < e) ? q + 1 : e;
+    } else {
+      /* records start with their length on a line */
+      q = memchr(p, '\n', e - p);
+      if(!q) {
+	if(!eof) {
+	  break;
+	}
+	fprintf(stderr, "Truncated record header\n");
+	return -1;
+      }
+      n = 0;
+      if(q == r) {
+	fprintf(stderr, "Invalid record header\n");
+	return -1;
+      }
+      for(; p < q; p++) {
+	if(*p < '0' || *p > '9' || n > (SIZE_MAX - 9) / 10) {
+	  fprintf(stderr, "Invalid record header\n");
+	  return -1;
+	}
+	n = n * 10 + (*p - '0');
+      }
+      if(n > (size_t)(e - q - 1)) {
+	if(!eof) {
+	  /* wait for the rest of the record */
+	  p = r;
+	  break;
+	}
+	fprintf(stderr, "Truncated record\n");
+	return -1;
+      }
+      batch_record(b, q + 1, n);
+      p = q + 1 + n;
+    }
+  }
+
+  return p - buf;
+}
+
+/* render records streamed from FD */
+static int batch_stream(struct batch *b, int fd)
+{
+  char *buf = NULL, *n;
+  size_t len = 0, cap = 0;
+  ssize_t rd, used;
+  int ret = 1;
+
+  while(1) {
+    if(cap - len < BATCH_READ) {
+      n = realloc(buf, cap + BATCH_READ);
+      if(!n) {
+	perror("realloc");
+	goto out;
+      }
+      buf = n;
+      cap += BATCH_READ;
+    }
+    rd = input_read(b->proc, fd, buf + len, cap - len);
+    if(rd == -1) {
+      goto out;
+    }
+    len += rd;
+
+    /* in record mode, render what is complete */
+    if(b->format != BATCH_NONE) {
+      used = batch_split(b, buf, len, rd == 0);
+      if(used < 0) {
+	goto out;
+      }
+      memmove(buf, buf + used, len - used);
+      len -= used;
+    }
+
+    if(rd == 0) {
+      break;
+    }
+  }
+
+  /* otherwise the whole input is one record */
+  if(b->format == BATCH_NONE) {
+    batch_record(b, buf, len);
+  }
+
+  ret = 0;
+
+ out:
+  free(buf);
+  return ret;
+}
+
+/* render the records of the current input file */
+static int batch_file(struct batch *b)
+{
+  struct processor *this = b->proc;
+
+  if(!this->imap) {
+    return batch_stream(b, this->ifd);
+  }
+  if(b->format == BATCH_NONE) {
+    batch_record(b, this->imap, this->imaplen);
+    return 0;
+  }
+  return batch_split(b, this->imap, this->imaplen, 1) < 0;
+}
+
+/* start NWORKERS threads rendering with the terminal of the main processor */
+static int batch_start(struct batch *b, int nworkers)
+{
+  struct batch_worker *w;
+  int i, j;
+
+  b->workers = calloc(nworkers, sizeof(*b->workers));
+  b->njobs = nworkers * BATCH_DEPTH;
+  b->jobs = calloc(b->njobs, sizeof(*b->jobs));
+  if(!b->workers || !b->jobs) {
+    fprintf(stderr, "Error allocating workers\n");
+    free(b->workers);
+    free(b->jobs);
+    b->workers = NULL;
+    b->jobs = NULL;
+    return 1;
+  }
+  pthread_mutex_init(&b->lock, NULL);
+  pthread_cond_init(&b->work, NULL);
+  pthread_cond_init(&b->done, NULL);
+
+  for(i = 0; i < nworkers; i++) {
+    w = &b->workers[i];
+    w->batch = b;
+    w->tmp.grow = 1;
+    init_renderer(&w->proc, b->proc);
+    w->proc.trace = b->proc->trace ? trace_ring() : NULL;
+    if(processor_setup_shared(&w->proc, b->proc)) {
+      return 1;
+    }
+    b->nworkers++;
+    for(j = 0; j < b->opts->ndefines; j++) {
+      define_var(&w->proc, b->opts->defines[j],
+		 strlen(b->opts->defines[j]));
+    }
+    /* templates cache renderings, so every worker has its own */
+    if(b->tmpl) {
+      w->tmpl = processor_template(&w->proc, b->tsrc.data, b->tsrc.len);
+      if(!w->tmpl) {
+	return 1;
+      }
+    }
+    if(pthread_create(&w->thread, NULL, batch_worker, w)) {
+      fprintf(stderr, "Error starting worker\n");
+      return 1;
+    }
+    w->running = 1;
+  }
+
+  return 0;
+}
+
+/* finish outstanding jobs and stop the workers */
+static void batch_stop(struct batch *b)
+{
+  struct batch_worker *w;
+  int i;
+
+  if(!b->workers) {
+    return;
+  }
+
+  batch_submit(b);
+  batch_drain(b, 0, 1);
+
+  pthread_mutex_lock(&b->lock);
+  b->stop = 1;
+  pthread_cond_broadcast(&b->work);
+  pthread_mutex_unlock(&b->lock);
+
+  for(i = 0; i < b->nworkers; i++) {
+    w = &b->workers[i];
+    if(w->running) {
+      pthread_join(w->thread, NULL);
+    }
+    processor_template_free(w->tmpl);
+    processor_stats_add(&b->proc->stats, &w->proc.stats);
+    processor_fini(&w->proc);
+    free(w->tmp.data);
+  }
+  for(i = 0; b->jobs && i < b->njobs; i++) {
+    free(b->jobs[i].in.data);
+    free(b->jobs[i].out.data);
+    free(b->jobs[i].lens);
+  }
+
+  pthread_cond_destroy(&b->done);
+  pthread_cond_destroy(&b->work);
+  pthread_mutex_destroy(&b->lock);
+  free(b->jobs);
+  free(b->workers);
+  b->workers = NULL;
+}
+
+/* read the template and prepare it */
+static int batch_template(struct batch *b, const char *path)
+{
+  ssize_t rd;
+  char *n;
+  int fd, ret = 1;
+
+  fd = open(path, O_RDONLY);
+  if(fd == -1) {
+    perror(path);
+    return 1;
+  }
+  do {
+    if(b->tsrc.cap - b->tsrc.len < BATCH_READ) {
+      n = realloc(b->tsrc.data, b->tsrc.cap + BATCH_READ);
+      if(!n) {
+	perror("realloc");
+	goto out;
+      }
+      b->tsrc.data = n;
+      b->tsrc.cap += BATCH_READ;
+    }
+    rd = read(fd, b->tsrc.data + b->tsrc.len, b->tsrc.cap - b->tsrc.len);
+    if(rd == -1) {
+      perror(path);
+      goto out;
+    }
+    b->tsrc.len += rd;
+  } while(rd);
+
+  b->tmpl = processor_template(b->proc, b->tsrc.data, b->tsrc.len);
+  if(!b->tmpl) {
+    fprintf(stderr, "Error preparing template %s\n", path);
+    goto out;
+  }
+
+  ret = 0;
+
+ out:
+  close(fd);
+  return ret;
+}
+
+int batch_run(struct processor *this, struct options *opts)
+{
+  struct batch b;
+  int i, res = 0;
+
+  memset(&b, 0, sizeof(b));
+  b.proc = this;
+  b.opts = opts;
+  b.format = opts->batch;
+  b.out.grow = 1;
+
+  if(opts->template) {
+    res = batch_template(&b, opts->template);
+  }
+  if(opts->jobs > 1 && !res) {
+    res = batch_start(&b, opts->jobs);
+  }
+
+  if(opts->nfiles == 0 && !res) {
+    res = batch_stream(&b, this->ifd);
+  }
+  for(i = 0; i < opts->nfiles && !res; i++) {
+    this->ifile = opts->ifiles[i];
+    res = init_input(this);
+    if(res) {
+      break;
+    }
+    res = batch_file(&b);
+    fini_input(this);
+  }
+  this->ifile = NULL;
+
+  batch_stop(&b);
+  processor_sync(this, FLUSH_DOCUMENT);
+  processor_template_free(b.tmpl);
+  free(b.tsrc.data);
+  free(b.out.data);
+
+  return res || b.errors;
+}
@@ -0,0 +1,519 @@
+/*
+ * tmlbench - throughput benchmarks for tml2tty and libtml
+ *
+ * Generates synthetic corpora, renders them through the tml2tty binary
+ * and through the library, and prints one JSON object per measurement.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ptrace.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "tml.h"
+
+/* a generated corpus */
+struct corpus {
+  const char *name;
+  void (*gen)(struct tml_buffer *b, int scale);
+  /* NUL separated records rather than one document */
+  int records;
+  /* generated data */
+  struct tml_buffer data;
+  size_t docs;
+  char path[256];
+};
+
+/* what was measured */
+struct result {
+  size_t docs;
+  size_t in;
+  size_t out;
+  double seconds;
+  /* -1 if not counted */
+  long syscalls;
+};
+
+struct bench {
+  int scale;
+  int runs;
+  char *term;
+  int width;
+  char *tml2tty;
+  char *label;
+  char dir[64];
+};
+
+static const char *words[] = {
+  "lorem", "ipsum", "dolor", "sit", "amet", "consectetur", "adipiscing",
+  "elit", "sed", "do", "eiusmod", "tempor", "incididunt", "ut", "labore",
+  "et", "dolore", "magna", "aliqua", "enim", "ad", "minim", "veniam",
+  "quis", "nostrud", "exercitation", "ullamco", "laboris", "nisi",
+  "aliquip", "ex", "ea", "commodo", "consequat",
+};
+#define NWORDS (sizeof(words) / sizeof(words[0]))
+
+/* reproducible pseudo random numbers */
+static unsigned long seed = 1;
+
+static unsigned rnd(unsigned n)
+{
+  seed = seed * 6364136223846793005ul + 1442695040888963407ul;
+  return (unsigned)(seed >> 33) % n;
+}
+
+static void buf_put(struct tml_buffer *b, const char *s, size_t len)
+{
+  char *n;
+  if(b->len + len > b->cap) {
+    b->cap = 2 * (b->cap + len);
+    n = realloc(b->data, b->cap);
+    if(!n) {
+      abort();
+    }
+    b->data = n;
+  }
+  memcpy(b->data + b->len, s, len);
+  b->len += len;
+}
+
+static void buf_str(struct tml_buffer *b, const char *s)
+{
+  buf_put(b, s, strlen(s));
+}
+
+static void buf_printf(struct tml_buffer *b, const char *fmt, ...)
+{
+  char tmp[256];
+  va_list ap;
+  int n;
+  va_start(ap, fmt);
+  n = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+  va_end(ap);
+  buf_put(b, tmp, n);
+}
+
+static void gen_words(struct tml_buffer *b, int n)
+{
+  int i;
+  for(i = 0; i < n; i++) {
+    if(i) {
+      buf_str(b, " ");
+    }
+    buf_str(b, words[rnd(NWORDS)]);
+  }
+}
+
+/* long plain paragraphs */
+static void gen_paragraphs(struct tml_buffer *b, int scale)
+{
+  size_t target = (size_t)scale << 22;
+  buf_str(b, "<tml>");
+  while(b->len < target) {
+    buf_str(b, "<p>");
+    gen_words(b, 40 + rnd(80));
+    buf_str(b, "</p>\n");
+  }
+  buf_str(b, "</tml>");
+}
+
+/* deeply nested spans */
+static void gen_nested(struct tml_buffer *b, int scale)
+{
+  static const char *open[] = { "<b>", "<i>", "<u>", "<red>", "<blue>" };
+  static const char *close[] = { "</b>", "</i>", "</u>", "</red>", "</blue>" };
+  size_t target = (size_t)scale << 21;
+  int depth, i, k[64];
+
+  buf_str(b, "<tml>");
+  while(b->len < target) {
+    depth = 8 + rnd(56);
+    for(i = 0; i < depth; i++) {
+      if(rnd(3) == 0) {
+	buf_printf(b, "<span fg=\"%u\" bg=\"%u\">", rnd(256), rnd(256));
+	k[i] = -1;
+      } else {
+	k[i] = rnd(5);
+	buf_str(b, open[k[i]]);
+      }
+      gen_words(b, 1 + rnd(3));
+      buf_str(b, " ");
+    }
+    while(i--) {
+      buf_str(b, k[i] < 0 ? "</span>" : close[k[i]]);
+    }
+    buf_str(b, "\n");
+  }
+  buf_str(b, "</tml>");
+}
+
+/* tables with colored cells */
+static void gen_table(struct tml_buffer *b, int scale)
+{
+  size_t target = (size_t)scale << 21;
+  int i;
+
+  buf_str(b, "<tml>");
+  while(b->len < target) {
+    for(i = 0; i < 8; i++) {
+      buf_printf(b, "<span bg=\"%u\" fg=\"%u\"> %-8s </span>",
+		 16 + rnd(216), rnd(16), words[rnd(NWORDS)]);
+    }
+    buf_str(b, "<br/>\n");
+  }
+  buf_str(b, "</tml>");
+}
+
+/* many tiny documents */
+static void gen_tiny(struct tml_buffer *b, int scale)
+{
+  int i, n = scale * 50000;
+  for(i = 0; i < n; i++) {
+    buf_printf(b, "<tml><b>host%u</b> <green>ok</green> "
+	       "<span fg=\"%u\">%u ms</span></tml>",
+	       rnd(1000), rnd(256), rnd(5000));
+    buf_put(b, "", 1);
+  }
+}
+
+static struct corpus corpora[] = {
+  { .name = "paragraphs", .gen = gen_paragraphs },
+  { .name = "nested", .gen = gen_nested },
+  { .name = "table", .gen = gen_table },
+  { .name = "tiny", .gen = gen_tiny, .records = 1 },
+};
+#define NCORPORA (sizeof(corpora) / sizeof(corpora[0]))
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int corpus_prepare(struct bench *bn, struct corpus *c)
+{
+  size_t i, done = 0;
+  ssize_t res;
+  int fd;
+
+  seed = 1;
+  c->gen(&c->data, bn->scale);
+  c->docs = 1;
+  if(c->records) {
+    c->docs = 0;
+    for(i = 0; i < c->data.len; i++) {
+      c->docs += c->data.data[i] == 0;
+    }
+  }
+
+  snprintf(c->path, sizeof(c->path), "%s/%s.tml", bn->dir, c->name);
+  fd = open(c->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd == -1) {
+    perror(c->path);
+    return 1;
+  }
+  while(done < c->data.len) {
+    res = write(fd, c->data.data + done, c->data.len - done);
+    if(res == -1) {
+      perror(c->path);
+      close(fd);
+      return 1;
+    }
+    done += res;
+  }
+  close(fd);
+  return 0;
+}
+
+/* start tml2tty on a corpus with its output on FD */
+static pid_t cli_spawn(struct bench *bn, struct corpus *c, int fd, int trace)
+{
+  char width[16];
+  char *argv[16];
+  int argc = 0;
+  pid_t pid;
+
+  snprintf(width, sizeof(width), "%d", bn->width);
+  argv[argc++] = bn->tml2tty;
+  argv[argc++] = "-t";
+  argv[argc++] = bn->term;
+  argv[argc++] = "-w";
+  argv[argc++] = width;
+  argv[argc++] = "-i";
+  argv[argc++] = c->path;
+  if(c->records) {
+    argv[argc++] = "-0";
+  }
+  argv[argc] = NULL;
+
+  pid = fork();
+  if(pid == 0) {
+    dup2(fd, 1);
+    if(trace) {
+      ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+    }
+    execv(argv[0], argv);
+    perror(argv[0]);
+    _exit(127);
+  }
+  return pid;
+}
+
+/* count the system calls of one run, following threads */
+static long cli_syscalls(struct bench *bn, struct corpus *c)
+{
+  long stops = 0;
+  pid_t pid, p;
+  int st, fd, first = 1, sig;
+
+  fd = open("/dev/null", O_WRONLY);
+  pid = cli_spawn(bn, c, fd, 1);
+  close(fd);
+  if(pid == -1) {
+    return -1;
+  }
+
+  while((p = waitpid(-1, &st, __WALL)) > 0) {
+    if(WIFEXITED(st) || WIFSIGNALED(st)) {
+      if(p == pid) {
+	break;
+      }
+      continue;
+    }
+    sig = 0;
+    if(first && p == pid) {
+      /* stopped at exec */
+      ptrace(PTRACE_SETOPTIONS, pid, NULL,
+	     PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL);
+      first = 0;
+    } else if(WSTOPSIG(st) == (SIGTRAP | 0x80)) {
+      stops++;
+    } else if(WSTOPSIG(st) != SIGTRAP && WSTOPSIG(st) != SIGSTOP) {
+      sig = WSTOPSIG(st);
+    }
+    ptrace(PTRACE_SYSCALL, p, NULL, (void *)(long)sig);
+  }
+
+  /* entry and exit stop each, but the final exit never returns */
+  return (stops + 1) / 2;
+}
+
+static int run_cli(struct bench *bn, struct corpus *c, struct result *r)
+{
+  char buf[65536];
+  double t0, t;
+  ssize_t n;
+  size_t out;
+  pid_t pid;
+  int fds[2], st, i;
+
+  r->seconds = -1;
+  for(i = 0; i < bn->runs; i++) {
+    if(pipe(fds) == -1) {
+      perror("pipe");
+      return 1;
+    }
+    t0 = now();
+    pid = cli_spawn(bn, c, fds[1], 0);
+    close(fds[1]);
+    out = 0;
+    while((n = read(fds[0], buf, sizeof(buf))) != 0) {
+      if(n == -1 && errno != EINTR) {
+	break;
+      }
+      if(n > 0) {
+	out += n;
+      }
+    }
+    close(fds[0]);
+    waitpid(pid, &st, 0);
+    t = now() - t0;
+    if(!WIFEXITED(st) || WEXITSTATUS(st) != 0) {
+      fprintf(stderr, "%s failed on %s\n", bn->tml2tty, c->name);
+      return 1;
+    }
+    if(r->seconds < 0 || t < r->seconds) {
+      r->seconds = t;
+    }
+    r->out = out;
+  }
+
+  r->docs = c->docs;
+  r->in = c->data.len;
+  r->syscalls = cli_syscalls(bn, c);
+  return 0;
+}
+
+static int run_lib(struct bench *bn, struct corpus *c, struct result *r)
+{
+  struct processor p;
+  struct tml_buffer out;
+  const char *d, *e, *q;
+  double t0, t;
+  int i, res = 0;
+
+  processor_init(&p);
+  p.term = bn->term;
+  p.ow = bn->width;
+  p.ofd = -1;
+  if(processor_setup(&p)) {
+    return 1;
+  }
+  memset(&out, 0, sizeof(out));
+  out.grow = 1;
+
+  r->seconds = -1;
+  for(i = 0; i < bn->runs && !res; i++) {
+    r->out = 0;
+    t0 = now();
+    d = c->data.data;
+    e = d + c->data.len;
+    while(d < e && !res) {
+      q = c->records ? memchr(d, 0, e - d) : e;
+      if(!q) {
+	q = e;
+      }
+      out.len = 0;
+      res = processor_render(&p, d, q - d, &out) != TML_OK;
+      r->out += out.len;
+      d = q + (q < e);
+    }
+    t = now() - t0;
+    if(r->seconds < 0 || t < r->seconds) {
+      r->seconds = t;
+    }
+  }
+
+  r->docs = c->docs;
+  r->in = c->data.len;
+  r->syscalls = -1;
+  free(out.data);
+  processor_fini(&p);
+  return res;
+}
+
+static void report(struct bench *bn, struct corpus *c,
+		   const char *mode, struct result *r)
+{
+  double s = r->seconds > 0 ? r->seconds : 1e-9;
+
+  printf("{\"label\":\"%s\",\"corpus\":\"%s\",\"mode\":\"%s\","
+	 "\"term\":\"%s\",\"width\":%d,\"docs\":%zu,"
+	 "\"in_bytes\":%zu,\"out_bytes\":%zu,\"seconds\":%.6f,"
+	 "\"mb_per_s\":%.3f,\"docs_per_s\":%.1f,\"out_per_in\":%.4f,",
+	 bn->label, c->name, mode, bn->term, bn->width, r->docs,
+	 r->in, r->out, r->seconds,
+	 r->in / s / 1e6, r->docs / s,
+	 r->in ? (double)r->out / r->in : 0.0);
+  if(r->syscalls >= 0) {
+    printf("\"syscalls\":%ld,\"syscalls_per_doc\":%.3f}\n",
+	   r->syscalls, (double)r->syscalls / (r->docs ? r->docs : 1));
+  } else {
+    printf("\"syscalls\":null,\"syscalls_per_doc\":null}\n");
+  }
+  fflush(stdout);
+}
+
+static void usage(const char *argv0)
+{
+  fprintf(stderr, "Usage: %s [-s scale] [-r runs] [-t term] [-w width]"
+	  " [-x tml2tty] [-l label] [corpus...]\n", argv0);
+}
+
+int main(int argc, char **argv)
+{
+  struct bench bn;
+  struct result r;
+  struct corpus *c;
+  size_t i;
+  int opt, j, ret = 0, want;
+
+  memset(&bn, 0, sizeof(bn));
+  bn.scale = 1;
+  bn.runs = 3;
+  bn.term = "xterm-256color";
+  bn.width = 80;
+  bn.tml2tty = "./tml2tty";
+  bn.label = "";
+
+  while((opt = getopt(argc, argv, "hs:r:t:w:x:l:")) != -1) {
+    switch(opt) {
+    case 's':
+      bn.scale = atoi(optarg);
+      break;
+    case 'r':
+      bn.runs = atoi(optarg);
+      break;
+    case 't':
+      bn.term = optarg;
+      break;
+    case 'w':
+      bn.width = atoi(optarg);
+      break;
+    case 'x':
+      bn.tml2tty = optarg;
+      break;
+    case 'l':
+      bn.label = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if(bn.scale < 1 || bn.runs < 1 || bn.width < 1) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  snprintf(bn.dir, sizeof(bn.dir), "/tmp/tmlbench.XXXXXX");
+  if(!mkdtemp(bn.dir)) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  for(i = 0; i < NCORPORA; i++) {
+    c = &corpora[i];
+    /* run only the corpora named on the command line */
+    want = optind == argc;
+    for(j = optind; j < argc; j++) {
+      want |= strcmp(argv[j], c->name) == 0;
+    }
+    if(!want) {
+      continue;
+    }
+
+    if(corpus_prepare(&bn, c)) {
+      ret = 1;
+      break;
+    }
+    memset(&r, 0, sizeof(r));
+    if(run_cli(&bn, c, &r) == 0) {
+      report(&bn, c, "cli", &r);
+    } else {
+      ret = 1;
+    }
+    memset(&r, 0, sizeof(r));
+    if(run_lib(&bn, c, &r) == 0) {
+      report(&bn, c, "lib", &r);
+    } else {
+      ret = 1;
+    }
+    unlink(c->path);
+    free(c->data.data);
+  }
+
+  rmdir(bn.dir);
+  return ret;
+}
@@ -63,7 +63,23 @@ fi
 
 echo ""
 
-verbose ${CC} -Wall -Wextra -Wno-unused -Wno-unused-parameter -g -O0 $CFLAGS $LINK -o tml2tty tml2tty.c
+WARN="-Wall -Wextra -Wno-unused -Wno-unused-parameter"
+
+# optimized build and benchmark run, results as JSON lines on stdout
+if [ "$1" = "bench" ]; then
+  shift
+  verbose ${CC} ${WARN} -O2 $CFLAGS -pthread -c -o bench/tml.o tml.c >&2
+  verbose ${CC} ${WARN} -O2 $CFLAGS -pthread -o bench/tml2tty tml2tty.c serve.c batch.c uring.c bench/tml.o $LINK >&2
+  verbose ${CC} ${WARN} -O2 $CFLAGS -pthread -I. -o bench/tmlbench bench/tmlbench.c bench/tml.o $LINK >&2
+  exec ./bench/tmlbench -x ./bench/tml2tty \
+       -l "$(git describe --always --dirty 2>/dev/null)" "$@"
+fi
+
+verbose ${CC} ${WARN} -g -O0 -fPIC $CFLAGS -pthread -c -o tml.o tml.c
+verbose ar rcs libtml.a tml.o
+verbose ${CC} -shared -pthread -o libtml.so tml.o $LINK
+verbose ${CC} ${WARN} -g -O0 $CFLAGS -pthread -o tml2tty tml2tty.c serve.c batch.c uring.c libtml.a $LINK
+verbose ${CC} ${WARN} -g -O0 -o tmltrace tmltrace.c
 
 echo ""
 
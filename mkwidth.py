@@ -0,0 +1,71 @@
+#!/usr/bin/env python3
+#
+# mkwidth.py - generate the display width table in width.h
+#
+# Widths follow wcwidth conventions: East Asian wide and fullwidth
+# characters take two columns, combining marks, format characters and
+# Hangul medial vowels take none, everything else takes one.
+#
+
+import unicodedata
+
+# code points covered by the table, the rest are handled in code
+LIMIT = 0x40000
+
+def width(c):
+    ch = chr(c)
+    cat = unicodedata.category(ch)
+    if c == 0x00ad:
+        return 1
+    if cat in ('Mn', 'Me', 'Cf') or 0x1160 <= c <= 0x11ff or c == 0x200b:
+        return 0
+    if 0x80 <= c < 0xa0:
+        return 0
+    if unicodedata.east_asian_width(ch) in ('W', 'F'):
+        return 2
+    return 1
+
+blocks = []
+index = []
+for hi in range(LIMIT >> 8):
+    block = bytearray(64)
+    for lo in range(256):
+        c = (hi << 8) | lo
+        if 0xd800 <= c < 0xe000:
+            w = 1
+        else:
+            w = width(c)
+        block[lo >> 2] |= w << ((lo & 3) * 2)
+    block = bytes(block)
+    if block not in blocks:
+        blocks.append(block)
+    index.append(blocks.index(block))
+
+assert len(blocks) < 256
+
+out = []
+out.append('/*')
+out.append(' * width.h - display width of code points, generated by mkwidth.py')
+out.append(' * from Unicode %s, do not edit' % unicodedata.unidata_version)
+out.append(' */')
+out.append('')
+out.append('/* code points covered by the table */')
+out.append('#define WIDTH_LIMIT 0x%x' % LIMIT)
+out.append('')
+out.append('/* block of every 256 code points */')
+out.append('static const unsigned char width_index[%d] = {' % len(index))
+for i in range(0, len(index), 16):
+    out.append('  ' + ' '.join('%d,' % x for x in index[i:i+16]))
+out.append('};')
+out.append('')
+out.append('/* two bits of width per code point */')
+out.append('static const unsigned char width_blocks[%d][64] = {' % len(blocks))
+for b in blocks:
+    out.append('  {')
+    for i in range(0, 64, 16):
+        out.append('    ' + ' '.join('0x%02x,' % x for x in b[i:i+16]))
+    out.append('  },')
+out.append('};')
+
+with open('width.h', 'w') as f:
+    f.write('\n'.join(out) + '\n')
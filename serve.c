@@ -0,0 +1,478 @@
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <curses.h>
+#include <term.h>
+
+#include "tml2tty.h"
+
+/* renderers kept warm at once */
+#define SERVE_POOL 16
+/* terminal types kept loaded at once */
+#define SERVE_TYPES 8
+/* largest request accepted, and largest response */
+#define SERVE_MAX (16 << 20)
+/* widest output a request may ask for */
+#define SERVE_WIDTH 4096
+/* events handled per wakeup */
+#define SERVE_EVENTS 64
+/* read granularity for requests */
+#define SERVE_READ 65536
+/* longest terminal name in a request */
+#define SERVE_TERM 64
+
+/* capabilities of one terminal type, shared by its renderers */
+struct termdef {
+  char term[SERVE_TERM];
+  /* last use, for eviction */
+  unsigned long used;
+  struct processor *proc;
+};
+
+/* a processor set up for one terminal type and width */
+struct renderer {
+  struct termdef *type;
+  int width;
+  /* last use, for eviction */
+  unsigned long used;
+  struct processor *proc;
+};
+
+/* a connected client */
+struct client {
+  int fd;
+  /* request as received */
+  struct tml_buffer in;
+  /* rendered response */
+  struct tml_buffer out;
+  size_t sent;
+  /* request is complete */
+  int replying;
+};
+
+static struct termdef types[SERVE_TYPES];
+static struct renderer pool[SERVE_POOL];
+static unsigned long pool_clock;
+
+static volatile sig_atomic_t serve_stop;
+
+static void serve_signal(int sig)
+{
+  serve_stop = 1;
+}
+
+/* release processor P, keeping its statistics */
+static void processor_drop(struct processor *this, struct processor *p)
+{
+  processor_stats_add(&this->stats, &p->stats);
+  processor_fini(p);
+  free(p);
+}
+
+/* a processor with our settings, not set up yet */
+static struct processor *processor_new(struct processor *this, int width)
+{
+  struct processor *p = malloc(sizeof(*p));
+  if(!p) {
+    return NULL;
+  }
+  init_renderer(p, this);
+  /* renderers run on one thread and share a ring */
+  p->trace = this->trace;
+  p->ow = width;
+  return p;
+}
+
+static void renderer_drop(struct processor *this, struct renderer *r)
+{
+  processor_drop(this, r->proc);
+  r->proc = NULL;
+  r->type = NULL;
+}
+
+static void termdef_drop(struct processor *this, struct termdef *t)
+{
+  int i;
+  /* renderers borrow the capabilities */
+  for(i = 0; i < SERVE_POOL; i++) {
+    if(pool[i].proc && pool[i].type == t) {
+      renderer_drop(this, &pool[i]);
+    }
+  }
+  processor_drop(this, t->proc);
+  t->proc = NULL;
+}
+
+/* find or load the capabilities of TERM */
+static struct termdef *termdef_get(struct processor *this, const char *term)
+{
+  struct termdef *t = NULL;
+  struct processor *p;
+  int i;
+
+  for(i = 0; i < SERVE_TYPES; i++) {
+    if(types[i].proc && strcmp(types[i].term, term) == 0) {
+      types[i].used = ++pool_clock;
+      return &types[i];
+    }
+  }
+
+  /* take a free slot or evict the least recently used */
+  for(i = 0; i < SERVE_TYPES; i++) {
+    if(!t || !types[i].proc || types[i].used < t->used) {
+      t = &types[i];
+      if(!t->proc) {
+	break;
+      }
+    }
+  }
+  if(t->proc) {
+    termdef_drop(this, t);
+  }
+
+  p = processor_new(this, this->ow);
+  if(!p) {
+    return NULL;
+  }
+  strcpy(t->term, term);
+  p->term = t->term;
+  if(processor_setup(p)) {
+    free(p);
+    return NULL;
+  }
+  /* capabilities are expanded, terminfo is not needed anymore and
+     would otherwise be loaded again for every type */
+  del_curterm(cur_term);
+
+  t->proc = p;
+  t->used = ++pool_clock;
+  return t;
+}
+
+/* find or create a renderer for TERM and WIDTH */
+static struct processor *renderer_get(struct processor *this,
+				      const char *term, int width)
+{
+  struct renderer *r = NULL;
+  struct termdef *t;
+  struct processor *p;
+  int i;
+
+  for(i = 0; i < SERVE_POOL; i++) {
+    if(pool[i].proc && pool[i].width == width
+       && strcmp(pool[i].type->term, term) == 0) {
+      pool[i].used = pool[i].type->used = ++pool_clock;
+      return pool[i].proc;
+    }
+  }
+
+  t = termdef_get(this, term);
+  if(!t) {
+    return NULL;
+  }
+
+  /* take a free slot or evict the least recently used */
+  for(i = 0; i < SERVE_POOL; i++) {
+    if(!r || !pool[i].proc || pool[i].used < r->used) {
+      r = &pool[i];
+      if(!r->proc) {
+	break;
+      }
+    }
+  }
+  if(r->proc) {
+    renderer_drop(this, r);
+  }
+
+  p = processor_new(this, width);
+  if(!p) {
+    return NULL;
+  }
+  if(processor_setup_shared(p, t->proc)) {
+    free(p);
+    return NULL;
+  }
+
+  r->proc = p;
+  r->type = t;
+  r->width = width;
+  r->used = ++pool_clock;
+  return p;
+}
+
+static void renderer_fini(struct processor *this)
+{
+  int i;
+  for(i = 0; i < SERVE_TYPES; i++) {
+    if(types[i].proc) {
+      termdef_drop(this, &types[i]);
+    }
+  }
+}
+
+static void client_close(struct client *c)
+{
+  close(c->fd);
+  free(c->in.data);
+  free(c->out.data);
+  free(c);
+}
+
+/* render a complete request, which is "<term> [<width>]\n<document>" */
+static int client_render(struct processor *this, struct client *c)
+{
+  char term[SERVE_TERM];
+  const char *p = c->in.data, *e = c->in.data + c->in.len;
+  const char *nl;
+  struct processor *r;
+  size_t n;
+  int width = 0;
+
+  nl = c->in.len ? memchr(p, '\n', c->in.len) : NULL;
+  if(!nl) {
+    fprintf(stderr, "Request without header\n");
+    return 1;
+  }
+
+  /* terminal type */
+  n = strcspn(p, " \t\n");
+  if(n == 0 || n >= sizeof(term) || p + n > nl) {
+    fprintf(stderr, "Request with bad terminal type\n");
+    return 1;
+  }
+  memcpy(term, p, n);
+  term[n] = 0;
+  p += n;
+
+  /* width */
+  while(p < nl && (*p == ' ' || *p == '\t')) {
+    p++;
+  }
+  while(p < nl && *p >= '0' && *p <= '9' && width <= SERVE_WIDTH) {
+    width = width * 10 + (*p++ - '0');
+  }
+  if(p != nl || width > SERVE_WIDTH) {
+    fprintf(stderr, "Request with bad width\n");
+    return 1;
+  }
+
+  /* a dash selects our own defaults */
+  if(strcmp(term, "-") == 0) {
+    snprintf(term, sizeof(term), "%s", this->term ? this->term : "dumb");
+  }
+  r = renderer_get(this, term, width ? width : this->ow);
+  if(!r) {
+    return 1;
+  }
+
+  /* responses that do not fit count as failed */
+  c->out.grow = 1;
+  c->out.max = SERVE_MAX;
+  return processor_render(r, nl + 1, e - nl - 1, &c->out) != TML_OK;
+}
+
+/* send as much of the response as possible, returns 1 when done */
+static int client_write(struct processor *this, struct client *c)
+{
+  ssize_t res;
+  while(c->sent < c->out.len) {
+    res = send(c->fd, c->out.data + c->sent, c->out.len - c->sent,
+	       MSG_NOSIGNAL);
+    this->stats.writes++;
+    if(res == -1) {
+      if(errno == EAGAIN || errno == EINTR) {
+	return 0;
+      }
+      return 1;
+    }
+    c->sent += res;
+    this->stats.obytes += res;
+  }
+  return 1;
+}
+
+/* receive request data, returns 1 once the client has finished */
+static int client_read(struct client *c)
+{
+  ssize_t res;
+  char *n;
+
+  while(1) {
+    if(c->in.cap - c->in.len < SERVE_READ) {
+      if(c->in.cap >= SERVE_MAX) {
+	fprintf(stderr, "Request too large\n");
+	return -1;
+      }
+      n = realloc(c->in.data, c->in.cap + SERVE_READ);
+      if(!n) {
+	return -1;
+      }
+      c->in.data = n;
+      c->in.cap += SERVE_READ;
+    }
+    res = read(c->fd, c->in.data + c->in.len, c->in.cap - c->in.len);
+    if(res == -1) {
+      if(errno == EAGAIN || errno == EINTR) {
+	return 0;
+      }
+      return -1;
+    }
+    if(res == 0) {
+      return 1;
+    }
+    c->in.len += res;
+  }
+}
+
+static void client_event(struct processor *this, int ep,
+			 struct client *c, uint32_t events)
+{
+  struct epoll_event ev;
+  int res;
+
+  /* still receiving */
+  if(!c->replying) {
+    res = client_read(c);
+    if(res < 0) {
+      client_close(c);
+      return;
+    }
+    if(res == 0) {
+      return;
+    }
+    if(client_render(this, c)) {
+      /* errors are answered with an empty response */
+      c->out.len = 0;
+    }
+    c->replying = 1;
+    ev.events = EPOLLOUT;
+    ev.data.ptr = c;
+    epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+  }
+
+  /* sending */
+  if(client_write(this, c)) {
+    client_close(c);
+  }
+}
+
+static int serve_listen(const char *path)
+{
+  struct sockaddr_un sa;
+  int fd;
+
+  if(strlen(path) >= sizeof(sa.sun_path)) {
+    fprintf(stderr, "Socket path too long: %s\n", path);
+    return -1;
+  }
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if(fd == -1) {
+    perror("socket");
+    return -1;
+  }
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  strcpy(sa.sun_path, path);
+  unlink(path);
+  if(bind(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1) {
+    perror(path);
+    goto err;
+  }
+  if(listen(fd, SOMAXCONN) == -1) {
+    perror("listen");
+    goto err;
+  }
+
+  return fd;
+
+ err:
+  close(fd);
+  return -1;
+}
+
+int serve_run(struct processor *this, struct options *opts)
+{
+  struct epoll_event ev, evs[SERVE_EVENTS];
+  struct sigaction sa;
+  struct client *c;
+  int sock, ep, fd, i, n, ret = 1;
+
+  sock = serve_listen(opts->serve);
+  if(sock == -1) {
+    return 1;
+  }
+
+  ep = epoll_create1(EPOLL_CLOEXEC);
+  if(ep == -1) {
+    perror("epoll_create1");
+    goto err_epoll;
+  }
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  if(epoll_ctl(ep, EPOLL_CTL_ADD, sock, &ev) == -1) {
+    perror("epoll_ctl");
+    goto err_ctl;
+  }
+
+  /* stop cleanly on interrupt */
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = serve_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  while(!serve_stop) {
+    n = epoll_wait(ep, evs, SERVE_EVENTS, -1);
+    if(n == -1) {
+      if(errno == EINTR) {
+	continue;
+      }
+      perror("epoll_wait");
+      goto err_ctl;
+    }
+    for(i = 0; i < n; i++) {
+      c = evs[i].data.ptr;
+      if(c) {
+	client_event(this, ep, c, evs[i].events);
+	continue;
+      }
+      /* accept everyone waiting */
+      while((fd = accept4(sock, NULL, NULL,
+			  SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+	c = calloc(1, sizeof(*c));
+	if(!c) {
+	  close(fd);
+	  continue;
+	}
+	c->fd = fd;
+	ev.events = EPOLLIN;
+	ev.data.ptr = c;
+	if(epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) == -1) {
+	  client_close(c);
+	}
+      }
+    }
+  }
+
+  ret = 0;
+
+ err_ctl:
+  close(ep);
+ err_epoll:
+  close(sock);
+  unlink(opts->serve);
+  renderer_fini(this);
+  return ret;
+}
@@ -0,0 +1,4336 @@
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <termios.h>
+#include <pthread.h>
+
+#include <curses.h>
+#include <term.h>
+
+#include <expat.h>
+
+#include "tml.h"
+#include "width.h"
+
+#define TOP 0
+#define BOTTOM 1
+#define LEFT 2
+#define RIGHT 3
+
+
+static int boolean_decode(const char *c, size_t len) {
+  return len == 4 && memcmp(c, "true", 4) == 0;
+}
+
+#ifndef COLOR_DEFAULT
+#define COLOR_DEFAULT -1
+#endif
+
+struct color {
+  char *name;
+  int value;
+};
+
+struct color colors[] = {
+  {"default", COLOR_DEFAULT},
+  {"black", COLOR_BLACK},
+  {"red", COLOR_RED},
+  {"green", COLOR_GREEN},
+  {"yellow", COLOR_YELLOW},
+  {"blue", COLOR_BLUE},
+  {"magenta", COLOR_MAGENTA},
+  {"cyan", COLOR_CYAN},
+  {"white", COLOR_WHITE},
+  {NULL},
+};
+
+/* find a named color by length and distinguishing character */
+static int color_lookup(const char *c, size_t len) {
+  int i = -1;
+  switch(len) {
+  case 3: i = 2; break;
+  case 6: i = 4; break;
+  case 4:
+    switch(c[0]) {
+    case 'b': i = 5; break;
+    case 'c': i = 7; break;
+    }
+    break;
+  case 5:
+    switch(c[0]) {
+    case 'b': i = 1; break;
+    case 'g': i = 3; break;
+    case 'w': i = 8; break;
+    }
+    break;
+  case 7:
+    switch(c[0]) {
+    case 'd': i = 0; break;
+    case 'm': i = 6; break;
+    }
+    break;
+  }
+  if(i >= 0 && memcmp(c, colors[i].name, len) != 0) {
+    i = -1;
+  }
+  return i;
+}
+
+/* levels of the 6x6x6 color cube of the 256 color palette */
+static const unsigned char cube_levels[6] = { 0, 95, 135, 175, 215, 255 };
+
+static int rgb_chroma(int r, int g, int b)
+{
+  int max = r > g ? (r > b ? r : b) : (g > b ? g : b);
+  int min = r < g ? (r < b ? r : b) : (g < b ? g : b);
+  return max - min;
+}
+
+/* squared distance of two colors, weighted for the eye, with a penalty
+   for changes in saturation so grays do not turn into colors */
+static int rgb_distance(int r1, int g1, int b1, int r2, int g2, int b2)
+{
+  int c = rgb_chroma(r1, g1, b1) - rgb_chroma(r2, g2, b2);
+  return 2 * (r1 - r2) * (r1 - r2) + 4 * (g1 - g2) * (g1 - g2)
+    + 3 * (b1 - b2) * (b1 - b2) + 3 * c * c;
+}
+
+/* nearest entry of the 256 color palette, from the cube or gray ramp */
+static int rgb_index(int r, int g, int b)
+{
+  int ri, gi, bi, y, yi, cube, gray;
+
+  ri = r < 48 ? 0 : r < 115 ? 1 : (r - 35) / 40;
+  gi = g < 48 ? 0 : g < 115 ? 1 : (g - 35) / 40;
+  bi = b < 48 ? 0 : b < 115 ? 1 : (b - 35) / 40;
+  cube = rgb_distance(r, g, b,
+		      cube_levels[ri], cube_levels[gi], cube_levels[bi]);
+
+  y = (r + g + b) / 3;
+  yi = y < 8 ? 0 : y > 238 ? 23 : (y - 3) / 10;
+  if(yi > 23) {
+    yi = 23;
+  }
+  gray = rgb_distance(r, g, b, 8 + 10 * yi, 8 + 10 * yi, 8 + 10 * yi);
+
+  return gray < cube ? 232 + yi : 16 + 36 * ri + 6 * gi + bi;
+}
+
+static int hex_digit(char c)
+{
+  if(c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  c |= 0x20;
+  if(c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  return -1;
+}
+
+/* decode #rgb and #rrggbb */
+static int color_hex(const char *c, size_t len)
+{
+  int v[6], i;
+  if(len != 4 && len != 7) {
+    return COLOR_DEFAULT;
+  }
+  for(i = 0; i < (int)len - 1; i++) {
+    v[i] = hex_digit(c[i + 1]);
+    if(v[i] < 0) {
+      return COLOR_DEFAULT;
+    }
+  }
+  if(len == 4) {
+    return rgb_index(v[0] * 17, v[1] * 17, v[2] * 17);
+  }
+  return rgb_index(v[0] * 16 + v[1], v[2] * 16 + v[3], v[4] * 16 + v[5]);
+}
+
+/* decode rgb(r, g, b) */
+static int color_rgb(const char *c, size_t len)
+{
+  const char *e = c + len;
+  int v[3] = { 0, 0, 0 }, i, n;
+
+  c += 4;
+  for(i = 0; i < 3; i++) {
+    while(c < e && *c == ' ') {
+      c++;
+    }
+    for(n = 0; c < e && isdigit((unsigned char)*c) && v[i] <= 255; n++) {
+      v[i] = v[i] * 10 + (*c++ - '0');
+    }
+    while(c < e && *c == ' ') {
+      c++;
+    }
+    if(!n || v[i] > 255 || c == e || *c++ != (i < 2 ? ',' : ')')) {
+      return COLOR_DEFAULT;
+    }
+  }
+  if(c != e) {
+    return COLOR_DEFAULT;
+  }
+  return rgb_index(v[0], v[1], v[2]);
+}
+
+static int color_decode(const char *c, size_t len) {
+  size_t i;
+  int res;
+
+  /* true colors */
+  if(len && c[0] == '#') {
+    return color_hex(c, len);
+  }
+  if(len > 4 && memcmp(c, "rgb(", 4) == 0) {
+    return color_rgb(c, len);
+  }
+
+  /* bright variants of the basic colors */
+  if(len > 6 && memcmp(c, "bright", 6) == 0) {
+    i = color_lookup(c + 6, len - 6);
+    return (int)i > 0 ? colors[i].value + 8 : COLOR_DEFAULT;
+  }
+
+  /* gray ramp of the 256 color palette */
+  if(len > 4 && (memcmp(c, "gray", 4) == 0 || memcmp(c, "grey", 4) == 0)
+     && isdigit((unsigned char)c[4])) {
+    res = color_decode(c + 4, len - 4);
+    return (res >= 0 && res < 24) ? 232 + res : COLOR_DEFAULT;
+  }
+
+  /* color names */
+  if(len && !isdigit((unsigned char)c[0])) {
+    i = color_lookup(c, len);
+    return (int)i >= 0 ? colors[i].value : COLOR_DEFAULT;
+  }
+
+  /* color numbers */
+  res = 0;
+  for(i = 0; i < len; i++) {
+    if(!isdigit((unsigned char)c[i]) || res > 0xffff) {
+      return COLOR_DEFAULT;
+    }
+    res = res * 10 + (c[i] - '0');
+  }
+  return len ? res : COLOR_DEFAULT;
+}
+
+/* style flags */
+#define STYLE_B        0x01
+#define STYLE_I        0x02
+#define STYLE_U        0x04
+#define STYLE_SUB      0x08
+#define STYLE_SUP      0x10
+#define STYLE_BLINK    0x20
+#define STYLE_REVERSE  0x40
+#define STYLE_STANDOUT 0x80
+#define STYLE_FLAGS    0xff
+#define STYLE_NFLAGS   8
+
+/* colors are stored biased by one so that zero is the default */
+#define STYLE_FG_SHIFT 8
+#define STYLE_BG_SHIFT 17
+#define STYLE_COLOR_MASK 0x1ff
+#define STYLE_COLOR_MAX 256
+
+/* parts of a style that are visible on blanks */
+#define STYLE_BLANK (STYLE_U | STYLE_REVERSE | STYLE_STANDOUT |	\
+		     ((style_t)STYLE_COLOR_MASK << STYLE_BG_SHIFT))
+
+static inline int style_fg(style_t s) {
+  return (int)((s >> STYLE_FG_SHIFT) & STYLE_COLOR_MASK) - 1;
+}
+
+static inline int style_bg(style_t s) {
+  return (int)((s >> STYLE_BG_SHIFT) & STYLE_COLOR_MASK) - 1;
+}
+
+static inline style_t style_color_bits(int c) {
+  if(c < 0 || c >= STYLE_COLOR_MAX) {
+    return 0;
+  }
+  return (style_t)(c + 1);
+}
+
+static inline style_t style_set_fg(style_t s, int c) {
+  s &= ~((style_t)STYLE_COLOR_MASK << STYLE_FG_SHIFT);
+  return s | (style_color_bits(c) << STYLE_FG_SHIFT);
+}
+
+static inline style_t style_set_bg(style_t s, int c) {
+  s &= ~((style_t)STYLE_COLOR_MASK << STYLE_BG_SHIFT);
+  return s | (style_color_bits(c) << STYLE_BG_SHIFT);
+}
+
+static inline style_t style_set_flag(style_t s, style_t flag, int on) {
+  return on ? (s | flag) : (s & ~flag);
+}
+
+/* style attributes, as used on span */
+enum attribute_id {
+  ATT_UNKNOWN = -1,
+  ATT_BACKGROUND,
+  ATT_FOREGROUND,
+  ATT_BG,
+  ATT_FG,
+  ATT_B,
+  ATT_I,
+  ATT_U,
+  ATT_SUB,
+  ATT_SUP,
+  ATT_BLINK,
+  ATT_REVERSE,
+  ATT_STANDOUT,
+};
+
+/* what an attribute controls */
+#define ATTK_FLAG 0
+#define ATTK_FG 1
+#define ATTK_BG 2
+
+struct attribute {
+  char *name;
+  int kind;
+  style_t flag;
+};
+
+struct attribute attributes[] = {
+  [ATT_BACKGROUND] = {"background", ATTK_BG, 0},
+  [ATT_FOREGROUND] = {"foreground", ATTK_FG, 0},
+  [ATT_BG] = {"bg", ATTK_BG, 0},
+  [ATT_FG] = {"fg", ATTK_FG, 0},
+  [ATT_B] = {"b", ATTK_FLAG, STYLE_B},
+  [ATT_I] = {"i", ATTK_FLAG, STYLE_I},
+  [ATT_U] = {"u", ATTK_FLAG, STYLE_U},
+  [ATT_SUB] = {"sub", ATTK_FLAG, STYLE_SUB},
+  [ATT_SUP] = {"sup", ATTK_FLAG, STYLE_SUP},
+  [ATT_BLINK] = {"blink", ATTK_FLAG, STYLE_BLINK},
+  [ATT_REVERSE] = {"reverse", ATTK_FLAG, STYLE_REVERSE},
+  [ATT_STANDOUT] = {"standout", ATTK_FLAG, STYLE_STANDOUT},
+};
+
+/* find an attribute by length and distinguishing character */
+static int attribute_lookup(const char *n, size_t len)
+{
+  int id = ATT_UNKNOWN;
+  switch(len) {
+  case 1:
+    switch(n[0]) {
+    case 'b': id = ATT_B; break;
+    case 'i': id = ATT_I; break;
+    case 'u': id = ATT_U; break;
+    }
+    break;
+  case 2:
+    switch(n[0]) {
+    case 'b': id = ATT_BG; break;
+    case 'f': id = ATT_FG; break;
+    }
+    break;
+  case 3:
+    switch(n[2]) {
+    case 'b': id = ATT_SUB; break;
+    case 'p': id = ATT_SUP; break;
+    }
+    break;
+  case 5: id = ATT_BLINK; break;
+  case 7: id = ATT_REVERSE; break;
+  case 8: id = ATT_STANDOUT; break;
+  case 10:
+    switch(n[0]) {
+    case 'b': id = ATT_BACKGROUND; break;
+    case 'f': id = ATT_FOREGROUND; break;
+    }
+    break;
+  }
+  if(id != ATT_UNKNOWN && memcmp(n, attributes[id].name, len) != 0) {
+    id = ATT_UNKNOWN;
+  }
+  return id;
+}
+
+/* apply decoded VALUE of attribute ID to a style */
+static style_t attribute_set(style_t s, int id, int value)
+{
+  switch(attributes[id].kind) {
+  case ATTK_FG:
+    return style_set_fg(s, value);
+  case ATTK_BG:
+    return style_set_bg(s, value);
+  default:
+    return style_set_flag(s, attributes[id].flag, value);
+  }
+}
+
+/* style bits controlled by attribute ID */
+static style_t attribute_mask(int id)
+{
+  switch(attributes[id].kind) {
+  case ATTK_FG:
+    return (style_t)STYLE_COLOR_MASK << STYLE_FG_SHIFT;
+  case ATTK_BG:
+    return (style_t)STYLE_COLOR_MASK << STYLE_BG_SHIFT;
+  default:
+    return attributes[id].flag;
+  }
+}
+
+static int attribute_decode(int id, const char *val, size_t len)
+{
+  if(attributes[id].kind == ATTK_FLAG) {
+    return boolean_decode(val, len);
+  } else {
+    return color_decode(val, len);
+  }
+}
+
+static void attr_zero(struct attributes *attr) {
+  attr->style = 0;
+}
+
+/* a precomputed control sequence in the capability pool */
+struct cap {
+  unsigned off;
+  unsigned len;
+};
+
+/* flags as passed to set_attributes */
+#define SGR_STANDOUT  0x01
+#define SGR_UNDERLINE 0x02
+#define SGR_REVERSE   0x04
+#define SGR_BLINK     0x08
+#define SGR_BOLD      0x10
+#define SGR_COMBOS    0x20
+
+/* style flags that set_attributes covers */
+#define STYLE_SGR (STYLE_B | STYLE_U | STYLE_BLINK | STYLE_REVERSE |	\
+		   STYLE_STANDOUT)
+
+/* highest number of colors we expand */
+#define CAPS_COLORS 256
+
+/* terminal capabilities, expanded once after setupterm */
+struct termcaps {
+  /* number of expanded colors */
+  int colors;
+  /* terminal has set_attributes */
+  int has_sgr;
+
+  /* reset all attributes */
+  struct cap sgr0;
+  /* clear to end of line */
+  struct cap el;
+  /* clearing uses the current background */
+  int bce;
+  /* set_attributes for every flag combination */
+  struct cap sgr[SGR_COMBOS];
+  /* individual modes by style flag bit */
+  struct cap enter[STYLE_NFLAGS];
+  struct cap exit[STYLE_NFLAGS];
+  /* flags the terminal can show, and those it can not turn on
+     or off on their own */
+  style_t shown;
+  style_t noenter;
+  style_t noexit;
+  /* orig_pair, which resets both colors */
+  struct cap op;
+  /* cheapest way to set each flag combination from scratch, with
+     set_attributes or with exit_attribute_mode and enter sequences,
+     and its length, which is SEQ_NONE if the terminal can do neither */
+  unsigned char rebuild_sgr[SGR_COMBOS];
+  unsigned short rebuild_len[SGR_COMBOS];
+  /* colors by index */
+  struct cap fg[CAPS_COLORS];
+  struct cap bg[CAPS_COLORS];
+  /* nearest terminal color for every palette entry, or -1 */
+  short map[CAPS_COLORS];
+
+  /* string storage */
+  char *pool;
+  size_t poollen;
+  size_t poolcap;
+  /* tiparm calls made while expanding */
+  unsigned long tiparms;
+};
+
+/* initial attribute stack size */
+#define ATTR_INITIAL 16
+/* default maximum nesting depth */
+#define ATTR_DEPTH 1024
+
+/* default output buffer size */
+#define OBUF_SIZE 65536
+/* default idle timeout in milliseconds */
+#define IDLE_TIMEOUT 10
+
+static struct attributes *attr_top(struct processor *this)
+{
+  return this->attrn ? &this->attrs[this->attrn - 1] : NULL;
+}
+
+static struct attributes *attr_push(struct processor *this);
+static void attr_sync(struct processor *this, style_t mask);
+static void attr_pop(struct processor *this);
+
+static uint64_t stats_clock(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* charge the time since the last switch to the running phase
+   and switch to PHASE, returning the previous one */
+static int stats_phase(struct processor *this, int phase)
+{
+  uint64_t now;
+  int old = this->phase;
+  if(!this->timed || phase == old) {
+    return old;
+  }
+  now = stats_clock();
+  if(this->phasestart) {
+    this->stats.ns[old] += now - this->phasestart;
+  }
+  this->phase = phase;
+  this->phasestart = now;
+  return old;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/* timestamps of trace records */
+static inline uint64_t trace_clock(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return stats_clock();
+#endif
+}
+
+static inline void trace_add(struct tml_trace *t, int type, int id,
+			     uint64_t off, size_t len)
+{
+  struct tml_trace_rec *r = &t->recs[t->head++ & t->mask];
+  r->time = trace_clock();
+  r->off = off;
+  r->len = len > 0xffff ? 0xffff : len;
+  r->type = type;
+  r->id = id;
+}
+
+/* record an event if tracing */
+#define TRACE(this, type, id, off, len)				\
+  do {								\
+    if(this->trace) {						\
+      trace_add(this->trace, type, id, off, len);		\
+    }								\
+  } while(0)
+
+/* write BUF, returns how much was written. unless BLOCK, an
+   asynchronous output only takes what it accepts right now. */
+static size_t emit_write(struct processor *this,
+			 const char *buf, size_t len, int block)
+{
+  struct pollfd pfd;
+  ssize_t res;
+  size_t done = 0;
+  int phase = stats_phase(this, PHASE_FLUSH);
+  this->stats.writes++;
+  if(this->writer) {
+    done = this->writer->write(this->writer, buf, len, block);
+    len = done;
+  }
+  while(done < len) {
+    res = write(this->ofd, buf + done, len - done);
+    if(res >= 0) {
+      done += res;
+      continue;
+    }
+    if(errno == EINTR) {
+      continue;
+    }
+    if(errno != EAGAIN && errno != EWOULDBLOCK) {
+      perror("write");
+      exit(1);
+    }
+    if(!block) {
+      break;
+    }
+    /* sleep until the output drains */
+    pfd.fd = this->ofd;
+    pfd.events = POLLOUT;
+    poll(&pfd, 1, -1);
+  }
+  this->stats.obytes += done;
+  stats_phase(this, phase);
+  return done;
+}
+
+/* write the first LEN bytes of the buffer, queueing what is left */
+static void emit_drain(struct processor *this, size_t len, int block)
+{
+  size_t done = emit_write(this, this->obuf, len, block);
+  if(done) {
+    memmove(this->obuf, this->obuf + done, this->olen - done);
+    this->olen -= done;
+  }
+  this->oqueued = len - done;
+}
+
+static void emit_flush(struct processor *this)
+{
+  /* memory output is already in place */
+  if(this->omem) {
+    return;
+  }
+  if(this->olen) {
+    emit_drain(this, this->olen, !this->oasync);
+  }
+}
+
+/* flush if the policy is at least as eager as LEVEL */
+static void emit_sync(struct processor *this, enum flush_policy level)
+{
+  if(this->flush <= (int)level) {
+    emit_flush(this);
+  }
+}
+
+/* make room in memory output, or drop what does not fit */
+static void emit_grow(struct processor *this, const char *buf, size_t len)
+{
+  struct tml_buffer *out = this->omem;
+  size_t n, cap;
+  char *data;
+
+  if(out->grow && (!out->max || this->ocap < out->max)) {
+    cap = 2 * this->ocap;
+    if(cap < this->olen + len) {
+      cap = this->olen + len;
+    }
+    if(cap < 256) {
+      cap = 256;
+    }
+    if(out->max && cap > out->max) {
+      cap = out->max;
+    }
+    data = realloc(this->obuf, cap);
+    if(!data) {
+      abort();
+    }
+    out->data = this->obuf = data;
+    out->cap = this->ocap = cap;
+  }
+  n = this->ocap - this->olen;
+  if(n > len) {
+    n = len;
+  }
+  memcpy(this->obuf + this->olen, buf, n);
+  this->olen += n;
+  out->lost += len - n;
+}
+
+static void emit_raw(struct processor *this, const char *buf, size_t len)
+{
+  size_t n;
+  /* empty records of batches come without a buffer */
+  if(len == 0) {
+    return;
+  }
+  TRACE(this, TRACE_EMIT, 0, this->stats.obytes + this->olen, len);
+  /* fast path */
+  if(len <= this->ocap - this->olen) {
+    memcpy(this->obuf + this->olen, buf, len);
+    this->olen += len;
+    return;
+  }
+  /* memory output never flushes */
+  if(this->omem) {
+    emit_grow(this, buf, len);
+    return;
+  }
+  /* large writes bypass the buffer */
+  if(this->olen == 0 && len >= this->ocap) {
+    n = emit_write(this, buf, len, !this->oasync);
+    buf += n;
+    len -= n;
+  }
+  /* fill the buffer, waiting for the output when it is full */
+  while(len > this->ocap - this->olen) {
+    n = this->ocap - this->olen;
+    memcpy(this->obuf + this->olen, buf, n);
+    this->olen += n;
+    buf += n;
+    len -= n;
+    emit_drain(this, this->olen, 1);
+  }
+  memcpy(this->obuf + this->olen, buf, len);
+  this->olen += len;
+}
+
+static void emit_ntimes(struct processor *this, char c, size_t count)
+{
+  char buf[32];
+  memset(buf, c, sizeof(buf));
+  while(count) {
+    size_t w = count;
+    if(w > sizeof(buf))
+      w = sizeof(buf);
+    emit_raw(this, buf, w);
+    count -= w;
+  }
+}
+
+static void emit_control(struct processor *this, const char *str)
+{
+  if(str) {
+    emit_raw(this, str, strlen(str));
+  }
+}
+
+static void emit_cap(struct processor *this, struct cap cap)
+{
+  if(cap.len) {
+    this->stats.escbytes += cap.len;
+    emit_raw(this, this->caps->pool + cap.off, cap.len);
+  }
+}
+
+static void emit_newline(struct processor *this)
+{
+  struct attributes *attr = attr_top(this);
+  if(this->debug)
+    fprintf(stderr, "emit_newline ol=%d oc=%d\n", this->ol, this->oc);
+  /* blanks that the line feed scrolls in take the current background */
+  attr_sync(this, STYLE_BLANK);
+  /* extend the background to the end of the line */
+  if(attr && style_bg(attr->style) != COLOR_DEFAULT && this->oc < this->ow) {
+    if(this->eolfill) {
+      emit_cap(this, this->caps->el);
+    } else {
+      emit_ntimes(this, ' ', this->ow - this->oc);
+    }
+  }
+  emit_control(this, this->rawtty ? "\r\n" : "\n");
+  emit_sync(this, FLUSH_LINE);
+  this->ol++; this->oc = 0;
+  this->stats.newlines++;
+}
+
+/* character classes for text tokenizing */
+#define CC_GRAPH   0
+#define CC_SPACE   1
+#define CC_TAB     2
+#define CC_NEWLINE 3
+#define CC_IGNORE  4
+#define CC_CONTROL 5
+
+/* tab stop distance */
+#define TAB_WIDTH 8
+
+static const unsigned char cclass[256] = {
+  [0x00 ... 0x08] = CC_CONTROL,
+  ['\t'] = CC_TAB,
+  ['\n'] = CC_NEWLINE,
+  ['\v'] = CC_IGNORE,
+  ['\f'] = CC_CONTROL,
+  ['\r'] = CC_IGNORE,
+  [0x0e ... 0x1f] = CC_CONTROL,
+  [' '] = CC_SPACE,
+  [0x7f] = CC_CONTROL,
+};
+
+/* length of the run of graphic characters at P */
+static size_t scan_graph_scalar(const char *p, size_t len)
+{
+  size_t i = 0;
+  while(i < len && cclass[(unsigned char)p[i]] == CC_GRAPH) {
+    i++;
+  }
+  return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+__attribute__((target("sse2")))
+static size_t scan_graph_sse2(const char *p, size_t len)
+{
+  const __m128i blank = _mm_set1_epi8(0x20);
+  const __m128i del = _mm_set1_epi8(0x7f);
+  size_t i = 0;
+  unsigned m;
+
+  for(; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+    /* bytes up to blank, unsigned, and delete */
+    __m128i c = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(v, blank), v),
+			     _mm_cmpeq_epi8(v, del));
+    m = (unsigned)_mm_movemask_epi8(c);
+    if(m) {
+      return i + __builtin_ctz(m);
+    }
+  }
+  return i + scan_graph_scalar(p + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_graph_avx2(const char *p, size_t len)
+{
+  const __m256i blank = _mm256_set1_epi8(0x20);
+  const __m256i del = _mm256_set1_epi8(0x7f);
+  size_t i = 0;
+  unsigned m;
+
+  for(; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+    __m256i c = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(v, blank), v),
+				_mm256_cmpeq_epi8(v, del));
+    m = (unsigned)_mm256_movemask_epi8(c);
+    if(m) {
+      return i + __builtin_ctz(m);
+    }
+  }
+  return i + scan_graph_sse2(p + i, len - i);
+}
+
+#endif
+
+/* selected during setup, before processors may run concurrently */
+static size_t (*scan_graph)(const char *p, size_t len) = scan_graph_scalar;
+
+static void scan_select(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2")) {
+    scan_graph = scan_graph_avx2;
+  } else if(__builtin_cpu_supports("sse2")) {
+    scan_graph = scan_graph_sse2;
+  }
+#endif
+}
+
+/* length of the run of ascii bytes at P */
+static size_t scan_ascii(const char *p, size_t len)
+{
+  size_t i = 0;
+  uint64_t w;
+  for(; i + 8 <= len; i += 8) {
+    memcpy(&w, p + i, 8);
+    if(w & 0x8080808080808080ull) {
+      break;
+    }
+  }
+  while(i < len && !(p[i] & 0x80)) {
+    i++;
+  }
+  return i;
+}
+
+/* decode the character at P into CP, returning its length,
+   invalid bytes decode one at a time as themselves */
+static size_t utf8_decode(const char *p, size_t len, uint32_t *cp)
+{
+  const unsigned char *u = (const unsigned char *)p;
+  uint32_t c = u[0], min;
+  size_t n, i;
+
+  if(c < 0xc2 || c > 0xf4) {
+    goto invalid;
+  } else if(c < 0xe0) {
+    n = 2; c &= 0x1f; min = 0x80;
+  } else if(c < 0xf0) {
+    n = 3; c &= 0x0f; min = 0x800;
+  } else {
+    n = 4; c &= 0x07; min = 0x10000;
+  }
+  if(n > len) {
+    goto invalid;
+  }
+  for(i = 1; i < n; i++) {
+    if((u[i] & 0xc0) != 0x80) {
+      goto invalid;
+    }
+    c = (c << 6) | (u[i] & 0x3f);
+  }
+  if(c < min || c > 0x10ffff || (c >= 0xd800 && c < 0xe000)) {
+    goto invalid;
+  }
+  *cp = c;
+  return n;
+
+ invalid:
+  *cp = u[0];
+  return 1;
+}
+
+/* columns taken by code point C */
+static inline int ucs_width(uint32_t c)
+{
+  if(c < WIDTH_LIMIT) {
+    return (width_blocks[width_index[c >> 8]][(c & 0xff) >> 2]
+	    >> ((c & 3) * 2)) & 3;
+  }
+  /* tags and variation selectors */
+  if(c >= 0xe0000 && c < 0xe1000) {
+    return 0;
+  }
+  return 1;
+}
+
+/* emit a run of graphic characters, wrapping at the output width */
+static void emit_chars(struct processor *this, const char *p, size_t len)
+{
+  size_t n, s, w, a, k, room;
+  uint32_t c;
+  int cw;
+  if(this->debug)
+    fprintf(stderr, "emit_chars len=%d\n", (int)len);
+  while(len) {
+    s = this->oc < this->ow ? (size_t)(this->ow - this->oc) : 0;
+    /* take whole characters while they fit */
+    n = w = 0;
+    while(n < len) {
+      if(!(p[n] & 0x80)) {
+	/* ascii takes a column per byte, a wide character may have
+	   overfilled the line already */
+	room = s > w ? s - w : 0;
+	a = scan_ascii(p + n, (len - n < room) ? len - n : room);
+	if(!a) {
+	  break;
+	}
+	n += a;
+	w += a;
+	continue;
+      }
+      k = utf8_decode(p + n, len - n, &c);
+      cw = ucs_width(c);
+      /* characters wider than a line still go on an empty one */
+      if(w + cw > s && (n || this->oc)) {
+	break;
+      }
+      n += k;
+      w += cw;
+    }
+    if(n) {
+      attr_sync(this, ~(style_t)0);
+      emit_raw(this, p, n);
+      this->oc += w;
+    }
+    if(n < len || w >= s) {
+      this->stats.wraps++;
+      emit_newline(this);
+    }
+    p += n;
+    len -= n;
+  }
+}
+
+/* emit COUNT blanks, dropping them at the start of a line */
+static void emit_blanks(struct processor *this, size_t count)
+{
+  size_t s;
+  if(this->oc > 0) {
+    s = this->oc < this->ow ? (size_t)(this->ow - this->oc) : 0;
+    if(count > s) {
+      count = s;
+    }
+    if(count) {
+      attr_sync(this, STYLE_BLANK);
+      emit_ntimes(this, ' ', count);
+      this->oc += count;
+    }
+  }
+}
+
+static void emit_text(struct processor *this, const char *str, size_t len)
+{
+  size_t i;
+  const char *p = str;
+  const char *e = str + len;
+
+  if(!str) {
+    return;
+  }
+
+  while(p < e) {
+    /* printable characters */
+    i = scan_graph(p, e - p);
+    if(i) {
+      emit_chars(this, p, i);
+      p += i;
+      continue;
+    }
+
+    switch(cclass[(unsigned char)*p]) {
+    case CC_SPACE:
+      /* runs of blanks */
+      i = 1;
+      while(p + i < e && p[i] == ' ') {
+	i++;
+      }
+      emit_blanks(this, i);
+      break;
+    case CC_TAB:
+      /* advance to the next tab stop */
+      i = 1;
+      emit_blanks(this, TAB_WIDTH - this->oc % TAB_WIDTH);
+      break;
+    case CC_NEWLINE:
+      i = 1;
+      emit_newline(this);
+      break;
+    default:
+      /* ignored whitespace and other control chars */
+      i = 1;
+      break;
+    }
+    p += i;
+  }
+}
+
+/* longest transition we ever build */
+#define SEQ_MAX 256
+/* marks sequences the terminal can not produce */
+#define SEQ_NONE 0xffff
+
+static void seq_add(struct termcaps *caps, char *seq, size_t *len,
+		    struct cap cap)
+{
+  if(*len + cap.len > SEQ_MAX) {
+    abort();
+  }
+  memcpy(seq + *len, caps->pool + cap.off, cap.len);
+  *len += cap.len;
+}
+
+/* set_attributes flags of style S */
+static int sgr_flags(style_t s)
+{
+  return ((s & STYLE_STANDOUT) ? SGR_STANDOUT : 0) |
+    ((s & STYLE_U) ? SGR_UNDERLINE : 0) |
+    ((s & STYLE_REVERSE) ? SGR_REVERSE : 0) |
+    ((s & STYLE_BLINK) ? SGR_BLINK : 0) |
+    ((s & STYLE_B) ? SGR_BOLD : 0);
+}
+
+/* add the enter or exit sequences of FLAGS */
+static void seq_flags(struct termcaps *caps, char *seq, size_t *len,
+		      const struct cap *caplist, style_t flags)
+{
+  int i;
+  for(i = 0; i < STYLE_NFLAGS; i++) {
+    if(flags & (1 << i)) {
+      seq_add(caps, seq, len, caplist[i]);
+    }
+  }
+}
+
+/* add the colors of NEW that look different from those of OLD */
+static void seq_colors(struct termcaps *caps, char *seq, size_t *len,
+		       style_t old, style_t new)
+{
+  int c;
+  /* set bg color, unless it looks the same on this terminal */
+  c = style_bg(new) >= 0 ? caps->map[style_bg(new)] : -1;
+  if(c >= 0 && (style_bg(old) < 0 || caps->map[style_bg(old)] != c)) {
+    seq_add(caps, seq, len, caps->bg[c]);
+  }
+  /* set fg color */
+  c = style_fg(new) >= 0 ? caps->map[style_fg(new)] : -1;
+  if(c >= 0 && (style_fg(old) < 0 || caps->map[style_fg(old)] != c)) {
+    seq_add(caps, seq, len, caps->fg[c]);
+  }
+}
+
+/* build NEW from scratch in the cheapest way found at setup */
+static size_t seq_rebuild(struct termcaps *caps, style_t new, char *seq)
+{
+  size_t len = 0;
+  int sgr = sgr_flags(new);
+  style_t have = 0;
+
+  /* set_attributes clears everything it does not set */
+  if(caps->rebuild_sgr[sgr]) {
+    seq_add(caps, seq, &len, caps->sgr[sgr]);
+    have = new & STYLE_SGR;
+  } else {
+    seq_add(caps, seq, &len, caps->sgr0);
+  }
+  seq_flags(caps, seq, &len, caps->enter, new & STYLE_FLAGS & ~have);
+  seq_colors(caps, seq, &len, 0, new);
+  return len;
+}
+
+/* change only what differs between OLD and NEW, returns 0 if that
+   leaves something of OLD in place */
+static int seq_update(struct termcaps *caps,
+		      style_t old, style_t new, char *seq, size_t *len)
+{
+  style_t off = old & ~new & STYLE_FLAGS, on = new & ~old & STYLE_FLAGS;
+  int complete = 1;
+
+  if((off & caps->noexit) || (on & caps->noenter)) {
+    complete = 0;
+  }
+  /* standout is often reverse, and leaving it ends both */
+  if((off & STYLE_STANDOUT) && (new & STYLE_REVERSE)) {
+    complete = 0;
+  }
+  seq_flags(caps, seq, len, caps->exit, off);
+  seq_flags(caps, seq, len, caps->enter, on);
+
+  /* default colors are reached through orig_pair */
+  if((style_bg(new) == COLOR_DEFAULT && style_bg(old) != COLOR_DEFAULT)
+     || (style_fg(new) == COLOR_DEFAULT && style_fg(old) != COLOR_DEFAULT)) {
+    if(!caps->op.len) {
+      complete = 0;
+    }
+    seq_add(caps, seq, len, caps->op);
+    old = style_set_bg(style_set_fg(old, COLOR_DEFAULT), COLOR_DEFAULT);
+  }
+  seq_colors(caps, seq, len, old, new);
+
+  return complete;
+}
+
+/* build the shortest control sequence that switches from OLD to NEW */
+static size_t attr_transition(struct termcaps *caps,
+			      style_t old, style_t new, char *seq)
+{
+  char alt[SEQ_MAX];
+  size_t len = 0, altlen;
+  int complete;
+
+  complete = seq_update(caps, old, new, seq, &len);
+  if(caps->rebuild_len[sgr_flags(new)] == SEQ_NONE) {
+    return len;
+  }
+  altlen = seq_rebuild(caps, new, alt);
+  if(!complete || altlen < len) {
+    memcpy(seq, alt, altlen);
+    len = altlen;
+  }
+  return len;
+}
+
+static void attr_switch(struct processor *this, style_t old, style_t new)
+{
+  uint64_t key = ((uint64_t)old << 32) | new;
+  struct transition *t;
+  char seq[SEQ_MAX];
+  size_t len;
+
+  if(old == new) {
+    return;
+  }
+
+  /* look for a memoized transition */
+  t = &this->tcache[((key * 0x9e3779b97f4a7c15ull) >> 56) & (TCACHE_SIZE - 1)];
+  if(t->used && t->key == key) {
+    TRACE(this, TRACE_SWITCH, 0, new, t->len);
+    this->stats.escbytes += t->len;
+    emit_raw(this, t->seq, t->len);
+    return;
+  }
+
+  /* build and remember it */
+  len = attr_transition(this->caps, old, new, seq);
+  if(len <= TCACHE_SEQ) {
+    t->used = 1;
+    t->key = key;
+    t->len = len;
+    memcpy(t->seq, seq, len);
+  }
+  TRACE(this, TRACE_SWITCH, 0, new, len);
+  this->stats.escbytes += len;
+  emit_raw(this, seq, len);
+}
+
+static struct attributes *attr_push(struct processor *this)
+{
+  struct attributes *new;
+
+  if((uint64_t)(this->attrn + this->attrover) > this->stats.depth) {
+    this->stats.depth = this->attrn + this->attrover;
+  }
+
+  /* refuse to nest deeper than allowed, not counting the base level */
+  if(this->attrover || this->attrn > this->attrmax) {
+    this->attrover++;
+    return &this->attrnull;
+  }
+
+  /* grow the stack */
+  if(this->attrn == this->attrcap) {
+    int cap = this->attrcap ? 2 * this->attrcap : ATTR_INITIAL;
+    if(cap > this->attrmax + 1) {
+      cap = this->attrmax + 1;
+    }
+    new = realloc(this->attrs, cap * sizeof(*new));
+    if(!new) {
+      abort();
+    }
+    this->attrs = new;
+    this->attrcap = cap;
+  }
+
+  /* inherit from the enclosing level */
+  new = &this->attrs[this->attrn];
+  if(this->attrn) {
+    *new = new[-1];
+  } else {
+    attr_zero(new);
+  }
+  new->id = this->attrid++;
+  this->attrn++;
+  return new;
+}
+
+/* bring the terminal to the current style before writing text,
+   if it differs in any of the bits in MASK */
+static void attr_sync(struct processor *this, style_t mask)
+{
+  style_t want = this->attrn ? this->attrs[this->attrn - 1].style : 0;
+  if((this->tstyle ^ want) & mask) {
+    attr_switch(this, this->tstyle, want);
+    this->tstyle = want;
+  }
+}
+
+static void attr_pop(struct processor *this)
+{
+  if(this->attrover) {
+    this->attrover--;
+    return;
+  }
+  if(this->attrn) {
+    this->attrn--;
+  }
+  if(!this->attrn && this->tstyle) {
+    /* leave the terminal clean */
+    emit_cap(this, this->caps->sgr0);
+    this->tstyle = 0;
+  }
+}
+
+static int fini_attr(struct processor *this)
+{
+  free(this->attrs);
+  this->attrs = NULL;
+  this->attrn = 0;
+  this->attrcap = 0;
+  this->attrover = 0;
+  return 0;
+}
+
+/* compiled documents start with a NUL, which is never valid xml */
+#define CODE_MAGIC "\0TML"
+/* bump whenever the meaning of the code changes */
+#define CODE_VERSION 2
+/* written in host order, read back to reject foreign files */
+#define CODE_ORDER 0x0102
+
+struct code_header {
+  char magic[4];
+  uint16_t version;
+  uint16_t order;
+  /* number of ops, followed by the string table */
+  uint32_t nops;
+  uint32_t nstr;
+};
+
+/* operations of compiled documents */
+enum code_opcode {
+  /* push a level with style (parent & ~a) | b */
+  OP_PUSH,
+  /* pop a level */
+  OP_POP,
+  /* text of b bytes at offset a of the string table */
+  OP_TEXT,
+  /* line break */
+  OP_BR,
+  /* paragraph start */
+  OP_PARA,
+  /* variable named by b bytes at offset a of the string table */
+  OP_VAR,
+  OP_COUNT,
+};
+
+struct code_op {
+  uint32_t op;
+  uint32_t a;
+  uint32_t b;
+};
+
+/* interned text of the string table */
+struct code_string {
+  uint32_t off;
+  uint32_t len;
+};
+
+/* state of processor_compile */
+struct compiler {
+  /* ops recorded */
+  struct code_op *ops;
+  size_t nops;
+  size_t opcap;
+  /* string table */
+  char *str;
+  size_t strlen;
+  size_t strcap;
+  /* text not yet interned */
+  char *text;
+  size_t textlen;
+  size_t textcap;
+  /* hash of interned strings, a power of two in size */
+  struct code_string *intern;
+  size_t internsize;
+  size_t internused;
+};
+
+/* append to a growable array */
+static void *comp_grow(void *data, size_t *cap, size_t need, size_t size)
+{
+  size_t n = *cap ? *cap : 64;
+  while(n < need) {
+    n *= 2;
+  }
+  if(n != *cap) {
+    data = realloc(data, n * size);
+    if(!data) {
+      abort();
+    }
+    *cap = n;
+  }
+  return data;
+}
+
+static uint32_t comp_hash(const char *p, size_t len)
+{
+  uint32_t h = 2166136261u;
+  while(len--) {
+    h = (h ^ (unsigned char)*p++) * 16777619u;
+  }
+  return h;
+}
+
+/* find or add a string, returning its place in the string table */
+static struct code_string comp_intern(struct compiler *c,
+				      const char *p, size_t len)
+{
+  struct code_string *old, *e;
+  size_t i, oldsize, mask;
+
+  /* keep the table at most half full */
+  if(2 * (c->internused + 1) > c->internsize) {
+    old = c->intern;
+    oldsize = c->internsize;
+    c->internsize = oldsize ? 2 * oldsize : 256;
+    c->intern = calloc(c->internsize, sizeof(*c->intern));
+    if(!c->intern) {
+      abort();
+    }
+    mask = c->internsize - 1;
+    for(i = 0; i < oldsize; i++) {
+      if(old[i].len) {
+	e = &c->intern[comp_hash(c->str + old[i].off, old[i].len) & mask];
+	while(e->len) {
+	  e = &c->intern[(e - c->intern + 1) & mask];
+	}
+	*e = old[i];
+      }
+    }
+    free(old);
+  }
+
+  mask = c->internsize - 1;
+  e = &c->intern[comp_hash(p, len) & mask];
+  while(e->len) {
+    if(e->len == len && memcmp(c->str + e->off, p, len) == 0) {
+      return *e;
+    }
+    e = &c->intern[(e - c->intern + 1) & mask];
+  }
+
+  c->str = comp_grow(c->str, &c->strcap, c->strlen + len, 1);
+  memcpy(c->str + c->strlen, p, len);
+  e->off = c->strlen;
+  e->len = len;
+  c->strlen += len;
+  c->internused++;
+  return *e;
+}
+
+static void comp_op(struct compiler *c, uint32_t op, uint32_t a, uint32_t b)
+{
+  c->ops = comp_grow(c->ops, &c->opcap, c->nops + 1, sizeof(*c->ops));
+  c->ops[c->nops].op = op;
+  c->ops[c->nops].a = a;
+  c->ops[c->nops].b = b;
+  c->nops++;
+}
+
+/* record pending text as a single run */
+static void comp_text(struct compiler *c)
+{
+  struct code_string str;
+  if(c->textlen) {
+    str = comp_intern(c, c->text, c->textlen);
+    comp_op(c, OP_TEXT, str.off, str.len);
+    c->textlen = 0;
+  }
+}
+
+static void fini_compiler(struct compiler *c)
+{
+  free(c->ops);
+  free(c->str);
+  free(c->text);
+  free(c->intern);
+}
+
+/* render primitives, executed directly or recorded while compiling */
+
+static void render_push(struct processor *this, style_t mask, style_t bits)
+{
+  struct attributes *a;
+  if(this->comp) {
+    comp_text(this->comp);
+    comp_op(this->comp, OP_PUSH, mask, bits);
+    return;
+  }
+  a = attr_push(this);
+  a->style = (a->style & ~mask) | bits;
+}
+
+static void render_pop(struct processor *this)
+{
+  if(this->comp) {
+    comp_text(this->comp);
+    comp_op(this->comp, OP_POP, 0, 0);
+    return;
+  }
+  attr_pop(this);
+}
+
+static void render_text(struct processor *this, const char *s, size_t len)
+{
+  struct compiler *c = this->comp;
+  if(c) {
+    /* adjacent character data becomes one run */
+    c->text = comp_grow(c->text, &c->textcap, c->textlen + len, 1);
+    memcpy(c->text + c->textlen, s, len);
+    c->textlen += len;
+    return;
+  }
+  emit_text(this, s, len);
+}
+
+static void render_br(struct processor *this)
+{
+  if(this->comp) {
+    comp_text(this->comp);
+    comp_op(this->comp, OP_BR, 0, 0);
+    return;
+  }
+  emit_newline(this);
+}
+
+static void render_para(struct processor *this)
+{
+  if(this->comp) {
+    comp_text(this->comp);
+    comp_op(this->comp, OP_PARA, 0, 0);
+    return;
+  }
+  if(this->oc > 0) {
+    emit_newline(this);
+  }
+}
+
+/* find the value of a template variable */
+static const struct tml_var *var_lookup(struct processor *this,
+					const char *name, size_t len)
+{
+  int i;
+  for(i = 0; i < this->nvars; i++) {
+    if(this->vars[i].namelen == len
+       && memcmp(this->vars[i].name, name, len) == 0) {
+      return &this->vars[i];
+    }
+  }
+  return NULL;
+}
+
+static void render_var(struct processor *this, const char *name, size_t len)
+{
+  const struct tml_var *v;
+  struct code_string str;
+  if(this->comp) {
+    comp_text(this->comp);
+    if(len) {
+      str = comp_intern(this->comp, name, len);
+      comp_op(this->comp, OP_VAR, str.off, str.len);
+    }
+    return;
+  }
+  v = var_lookup(this, name, len);
+  if(v) {
+    emit_text(this, v->value, v->len);
+  }
+}
+
+struct element;
+
+/* an attribute of an element, pointing into the input */
+struct tml_att {
+  const char *name;
+  size_t namelen;
+  const char *value;
+  size_t len;
+};
+
+static void element_span_start(struct processor *this,
+			       const struct element *e,
+			       const struct tml_att *atts, int natts)
+{
+  int i, id;
+  style_t mask = 0, bits = 0, m;
+  for(i = 0; i < natts; i++) {
+    id = attribute_lookup(atts[i].name, atts[i].namelen);
+    if(id != ATT_UNKNOWN) {
+      m = attribute_mask(id);
+      bits = (bits & ~m)
+	| attribute_set(0, id, attribute_decode(id, atts[i].value,
+						atts[i].len));
+      mask |= m;
+    }
+  }
+  render_push(this, mask, bits);
+}
+
+static void element_style_start(struct processor *this,
+				const struct element *e,
+				const struct tml_att *atts, int natts);
+
+static void element_attr_end(struct processor *this)
+{
+  render_pop(this);
+}
+
+
+static void element_br_start(struct processor *this,
+			     const struct element *e,
+			     const struct tml_att *atts, int natts)
+{
+  render_br(this);
+}
+
+static void element_p_start(struct processor *this,
+			    const struct element *e,
+			    const struct tml_att *atts, int natts)
+{
+  render_para(this);
+}
+
+static void element_p_end(struct processor *this)
+{
+#if 0
+  if(this->oc > 0) {
+    emit_newline(this);
+  }
+#endif
+}
+
+static void element_var_start(struct processor *this,
+			      const struct element *e,
+			      const struct tml_att *atts, int natts)
+{
+  int i;
+  for(i = 0; i < natts; i++) {
+    if(atts[i].namelen == 4 && memcmp(atts[i].name, "name", 4) == 0) {
+      render_var(this, atts[i].value, atts[i].len);
+    }
+  }
+}
+
+static void element_tml_start(struct processor *this,
+			      const struct element *e,
+			      const struct tml_att *atts, int natts)
+{
+}
+
+static void element_tml_end(struct processor *this)
+{
+}
+
+/* elements of the markup */
+enum element_id {
+  ELEM_UNKNOWN = -1,
+  ELEM_SPAN,
+  ELEM_B,
+  ELEM_I,
+  ELEM_U,
+  ELEM_SUB,
+  ELEM_SUP,
+  ELEM_BLINK,
+  ELEM_REVERSE,
+  ELEM_STANDOUT,
+  ELEM_BLACK,
+  ELEM_RED,
+  ELEM_GREEN,
+  ELEM_YELLOW,
+  ELEM_BLUE,
+  ELEM_MAGENTA,
+  ELEM_CYAN,
+  ELEM_WHITE,
+  ELEM_BR,
+  ELEM_P,
+  ELEM_VAR,
+  ELEM_S,
+  ELEM_TT,
+  ELEM_BIG,
+  ELEM_SMALL,
+  ELEM_TML,
+  ELEM_COUNT,
+};
+
+struct element {
+  char *name;
+  void (*element_start)(struct processor *this,
+			const struct element *e,
+			const struct tml_att *atts, int natts);
+  void (*element_end)(struct processor *this);
+  /* attribute implied by the element */
+  int att;
+  /* value of the implied attribute */
+  int value;
+};
+
+struct element elements[] = {
+  /* attributes */
+  [ELEM_SPAN] = {"span", element_span_start, element_attr_end},
+  [ELEM_B] = {"b", element_style_start, element_attr_end, ATT_B, 1},
+  [ELEM_I] = {"i", element_style_start, element_attr_end, ATT_I, 1},
+  [ELEM_U] = {"u", element_style_start, element_attr_end, ATT_U, 1},
+  [ELEM_SUB] = {"sub", element_style_start, element_attr_end, ATT_SUB, 1},
+  [ELEM_SUP] = {"sup", element_style_start, element_attr_end, ATT_SUP, 1},
+  [ELEM_BLINK] = {"blink", element_style_start, element_attr_end,
+		  ATT_BLINK, 1},
+  [ELEM_REVERSE] = {"reverse", element_style_start, element_attr_end,
+		    ATT_REVERSE, 1},
+  [ELEM_STANDOUT] = {"standout", element_style_start, element_attr_end,
+		     ATT_STANDOUT, 1},
+  /* colors */
+  [ELEM_BLACK] = {"black", element_style_start, element_attr_end,
+		  ATT_FG, COLOR_BLACK},
+  [ELEM_RED] = {"red", element_style_start, element_attr_end,
+		ATT_FG, COLOR_RED},
+  [ELEM_GREEN] = {"green", element_style_start, element_attr_end,
+		  ATT_FG, COLOR_GREEN},
+  [ELEM_YELLOW] = {"yellow", element_style_start, element_attr_end,
+		   ATT_FG, COLOR_YELLOW},
+  [ELEM_BLUE] = {"blue", element_style_start, element_attr_end,
+		 ATT_FG, COLOR_BLUE},
+  [ELEM_MAGENTA] = {"magenta", element_style_start, element_attr_end,
+		    ATT_FG, COLOR_MAGENTA},
+  [ELEM_CYAN] = {"cyan", element_style_start, element_attr_end,
+		 ATT_FG, COLOR_CYAN},
+  [ELEM_WHITE] = {"white", element_style_start, element_attr_end,
+		  ATT_FG, COLOR_WHITE},
+  /* formatting */
+  [ELEM_BR] = {"br", element_br_start, NULL},
+  [ELEM_P] = {"p", element_p_start, element_p_end},
+  /* templates */
+  [ELEM_VAR] = {"var", element_var_start, NULL},
+  /* compatibility */
+  [ELEM_S] = {"s", NULL, NULL},
+  [ELEM_TT] = {"tt", NULL, NULL},
+  [ELEM_BIG] = {"big", NULL, NULL},
+  [ELEM_SMALL] = {"small", NULL, NULL},
+  /* structural */
+  [ELEM_TML] = {"tml", element_tml_start, element_tml_end},
+  /* end */
+  [ELEM_COUNT] = {NULL},
+};
+
+/* find an element by length and distinguishing character */
+static int element_lookup(const char *n, size_t len)
+{
+  int id = ELEM_UNKNOWN;
+  switch(len) {
+  case 1:
+    switch(n[0]) {
+    case 'b': id = ELEM_B; break;
+    case 'i': id = ELEM_I; break;
+    case 'u': id = ELEM_U; break;
+    case 'p': id = ELEM_P; break;
+    case 's': id = ELEM_S; break;
+    }
+    break;
+  case 2:
+    switch(n[0]) {
+    case 'b': id = ELEM_BR; break;
+    case 't': id = ELEM_TT; break;
+    }
+    break;
+  case 3:
+    switch(n[2]) {
+    case 'b': id = ELEM_SUB; break;
+    case 'p': id = ELEM_SUP; break;
+    case 'd': id = ELEM_RED; break;
+    case 'g': id = ELEM_BIG; break;
+    case 'l': id = ELEM_TML; break;
+    case 'r': id = ELEM_VAR; break;
+    }
+    break;
+  case 4:
+    switch(n[0]) {
+    case 's': id = ELEM_SPAN; break;
+    case 'b': id = ELEM_BLUE; break;
+    case 'c': id = ELEM_CYAN; break;
+    }
+    break;
+  case 5:
+    switch(n[3]) {
+    case 'n': id = ELEM_BLINK; break;
+    case 'c': id = ELEM_BLACK; break;
+    case 'e': id = ELEM_GREEN; break;
+    case 't': id = ELEM_WHITE; break;
+    case 'l': id = ELEM_SMALL; break;
+    }
+    break;
+  case 6: id = ELEM_YELLOW; break;
+  case 7:
+    switch(n[0]) {
+    case 'r': id = ELEM_REVERSE; break;
+    case 'm': id = ELEM_MAGENTA; break;
+    }
+    break;
+  case 8: id = ELEM_STANDOUT; break;
+  }
+  if(id != ELEM_UNKNOWN && memcmp(n, elements[id].name, len) != 0) {
+    id = ELEM_UNKNOWN;
+  }
+  return id;
+}
+
+static void element_style_start(struct processor *this,
+				const struct element *e,
+				const struct tml_att *atts, int natts)
+{
+  render_push(this, attribute_mask(e->att),
+	      attribute_set(0, e->att, e->value));
+}
+
+/* pipelined mode: the parser runs on the caller's thread and passes
+   render events through a ring to an emitter thread that does layout
+   and output. the ring is a single-producer single-consumer queue of
+   records, locks are only taken by a side that goes to sleep. */
+
+/* record types */
+#define PIPE_START  1
+#define PIPE_END    2
+#define PIPE_TEXT   3
+#define PIPE_BEGIN  4
+#define PIPE_FINISH 5
+#define PIPE_FLUSH  6
+#define PIPE_SYNC   7
+#define PIPE_WRITE  8
+#define PIPE_QUIT   9
+/* filler up to the end of the ring */
+#define PIPE_PAD    10
+
+/* ring size, a power of two */
+#define PIPE_RING (1 << 20)
+/* most payload per record, longer text is split */
+#define PIPE_CHUNK (PIPE_RING / 8)
+/* bytes passed between updates of the shared positions */
+#define PIPE_BATCH 16384
+
+/* who is sleeping */
+#define PIPE_WAIT_DATA 1
+#define PIPE_WAIT_ROOM 2
+
+/* a record in the ring, followed by its payload */
+struct pipe_rec {
+  /* bytes including the header, a multiple of 8 */
+  uint32_t size;
+  uint8_t type;
+  /* element, or flush level */
+  uint8_t id;
+  uint16_t natts;
+  /* input offset, for traces */
+  uint32_t off;
+  /* payload bytes */
+  uint32_t len;
+};
+
+/* an attribute of a start record, followed by name and value */
+struct pipe_att {
+  uint32_t namelen;
+  uint32_t len;
+};
+
+struct tml_pipeline {
+  /* parser on the caller's thread */
+  struct processor parser;
+  pthread_t thread;
+  char *ring;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  int waiting;
+
+  /* producer side: write position, the part of it published, and
+     the last consumer position seen */
+  uint64_t wpos __attribute__((aligned(64)));
+  uint64_t head;
+  uint64_t seen;
+  /* documents handed over */
+  uint64_t finishing;
+
+  /* consumer side: read position, the part of it published */
+  uint64_t rpos __attribute__((aligned(64)));
+  uint64_t tail;
+  /* documents completed */
+  uint64_t finished;
+};
+
+/* wake the other side if it sleeps on WHO, after progress */
+static void pipe_wake(struct tml_pipeline *p, int who)
+{
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if(__atomic_load_n(&p->waiting, __ATOMIC_RELAXED) & who) {
+    pthread_mutex_lock(&p->lock);
+    pthread_cond_broadcast(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+  }
+}
+
+/* let the emitter see all records written */
+static void pipe_publish(struct tml_pipeline *p)
+{
+  if(p->wpos != p->head) {
+    __atomic_store_n(&p->head, p->wpos, __ATOMIC_RELEASE);
+    pipe_wake(p, PIPE_WAIT_DATA);
+  }
+}
+
+/* the producer has to wait for N bytes of room or a document */
+static int pipe_behind(struct tml_pipeline *p, size_t n)
+{
+  p->seen = __atomic_load_n(&p->tail, __ATOMIC_SEQ_CST);
+  return PIPE_RING - (p->wpos - p->seen) < n
+    || __atomic_load_n(&p->finished, __ATOMIC_SEQ_CST) != p->finishing;
+}
+
+/* wait for N bytes of room and finished documents */
+static void pipe_room(struct tml_pipeline *p, size_t n)
+{
+  int phase;
+
+  if(PIPE_RING - (p->wpos - p->seen) >= n || !pipe_behind(p, n)) {
+    return;
+  }
+  /* waiting for the emitter is not parse time */
+  phase = stats_phase(&p->parser, PHASE_IDLE);
+  pipe_publish(p);
+  pthread_mutex_lock(&p->lock);
+  __atomic_fetch_or(&p->waiting, PIPE_WAIT_ROOM, __ATOMIC_SEQ_CST);
+  while(pipe_behind(p, n)) {
+    pthread_cond_wait(&p->wake, &p->lock);
+  }
+  __atomic_fetch_and(&p->waiting, ~PIPE_WAIT_ROOM, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&p->lock);
+  stats_phase(&p->parser, phase);
+}
+
+/* a contiguous record of SIZE bytes at the write position */
+static struct pipe_rec *pipe_reserve(struct tml_pipeline *p, int type,
+				     size_t size)
+{
+  size_t at = p->wpos & (PIPE_RING - 1);
+  struct pipe_rec *r;
+
+  /* skip the end of the ring if it does not fit, the filler only
+     has its size and type, which fit in the 8 bytes left at least */
+  if(PIPE_RING - at < size) {
+    pipe_room(p, PIPE_RING - at + size);
+    r = (struct pipe_rec *)(p->ring + at);
+    r->size = PIPE_RING - at;
+    r->type = PIPE_PAD;
+    p->wpos += r->size;
+    at = 0;
+  }
+  pipe_room(p, size);
+
+  r = (struct pipe_rec *)(p->ring + at);
+  r->size = size;
+  r->type = type;
+  r->id = 0;
+  r->natts = 0;
+  r->off = 0;
+  r->len = 0;
+  return r;
+}
+
+static void pipe_commit(struct tml_pipeline *p, struct pipe_rec *r)
+{
+  p->wpos += r->size;
+  if(p->wpos - p->head >= PIPE_BATCH) {
+    pipe_publish(p);
+  }
+}
+
+/* a record with LEN bytes of DATA */
+static void pipe_event(struct tml_pipeline *p, int type, int id,
+		       uint64_t off, const char *data, size_t len)
+{
+  struct pipe_rec *r = pipe_reserve(p, type, (sizeof(*r) + len + 7) & ~7);
+  r->id = id;
+  r->off = off;
+  r->len = len;
+  if(len) {
+    memcpy(r + 1, data, len);
+  }
+  pipe_commit(p, r);
+}
+
+/* text in records of at most PIPE_CHUNK, split between characters */
+static void pipe_text(struct tml_pipeline *p, int type,
+		      const char *s, size_t len, uint64_t off)
+{
+  size_t n;
+  do {
+    n = len;
+    if(n > PIPE_CHUNK) {
+      n = PIPE_CHUNK;
+      while(n > 1 && (s[n] & 0xc0) == 0x80) {
+	n--;
+      }
+    }
+    pipe_event(p, type, 0xff, off, s, n);
+    s += n;
+    off += n;
+    len -= n;
+  } while(len);
+}
+
+static void pipe_start(struct tml_pipeline *p, int id,
+		       const struct tml_att *atts, int natts, uint64_t off)
+{
+  struct pipe_rec *r;
+  struct pipe_att pa;
+  size_t size = sizeof(*r);
+  char *q;
+  int i;
+
+  for(i = 0; i < natts; i++) {
+    if(size + sizeof(pa) + atts[i].namelen + atts[i].len > PIPE_CHUNK) {
+      fprintf(stderr, "Attributes too large, dropping %d\n", natts - i);
+      break;
+    }
+    size += sizeof(pa) + atts[i].namelen + atts[i].len;
+  }
+  natts = i;
+
+  r = pipe_reserve(p, PIPE_START, (size + 7) & ~7);
+  r->id = id & 0xff;
+  r->natts = natts;
+  r->off = off;
+  q = (char *)(r + 1);
+  for(i = 0; i < natts; i++) {
+    pa.namelen = atts[i].namelen;
+    pa.len = atts[i].len;
+    memcpy(q, &pa, sizeof(pa));
+    q += sizeof(pa);
+    memcpy(q, atts[i].name, pa.namelen);
+    q += pa.namelen;
+    memcpy(q, atts[i].value, pa.len);
+    q += pa.len;
+  }
+  pipe_commit(p, r);
+}
+
+/* rendering of parser events */
+
+static void event_render_start(struct processor *this, int id,
+			       const struct tml_att *atts, int natts,
+			       uint64_t off)
+{
+  int phase;
+  TRACE(this, TRACE_START, id & 0xff, off, 0);
+  if(id != ELEM_UNKNOWN) {
+    phase = stats_phase(this, PHASE_EMIT);
+    if(elements[id].element_start) {
+      elements[id].element_start(this, &elements[id], atts, natts);
+    }
+    emit_sync(this, FLUSH_EVENT);
+    stats_phase(this, phase);
+  }
+}
+
+static void event_render_end(struct processor *this, int id, uint64_t off)
+{
+  int phase;
+  TRACE(this, TRACE_END, id & 0xff, off, 0);
+  if(id != ELEM_UNKNOWN) {
+    phase = stats_phase(this, PHASE_EMIT);
+    if(elements[id].element_end) {
+      elements[id].element_end(this);
+    }
+    emit_sync(this, FLUSH_EVENT);
+    stats_phase(this, phase);
+  }
+}
+
+static void event_render_text(struct processor *this,
+			      const char *s, size_t len, uint64_t off)
+{
+  int phase;
+  TRACE(this, TRACE_CDATA, 0xff, off, len);
+  phase = stats_phase(this, PHASE_EMIT);
+  render_text(this, s, len);
+  emit_sync(this, FLUSH_EVENT);
+  stats_phase(this, phase);
+}
+
+/* parser events, from the tokenizer or from expat, rendered here
+   or passed to the emitter thread */
+
+static void event_start(struct processor *this, int id,
+			const char *name, size_t namelen,
+			const struct tml_att *atts, int natts, uint64_t off)
+{
+  if(this->debug)
+    fprintf(stderr, "%.*s:start\n", (int)namelen, name);
+  this->stats.elements++;
+  if(this->pipeline) {
+    pipe_start(this->pipeline, id, atts, natts, off);
+  } else {
+    event_render_start(this, id, atts, natts, off);
+  }
+}
+
+static void event_end(struct processor *this, int id,
+		      const char *name, size_t namelen, uint64_t off)
+{
+  if(this->debug)
+    fprintf(stderr, "%.*s:end\n", (int)namelen, name);
+  if(this->pipeline) {
+    pipe_event(this->pipeline, PIPE_END, id & 0xff, off, NULL, 0);
+  } else {
+    event_render_end(this, id, off);
+  }
+}
+
+static void event_text(struct processor *this,
+		       const char *s, size_t len, uint64_t off)
+{
+  if(this->debug)
+    fprintf(stderr, "cdata:%d\n", (int)len);
+  if(this->pipeline) {
+    pipe_text(this->pipeline, PIPE_TEXT, s, len, off);
+  } else {
+    event_render_text(this, s, len, off);
+  }
+}
+
+/* room for N attributes */
+static struct tml_att *atts_grow(struct processor *this, int n)
+{
+  struct tml_att *a;
+  int cap;
+  if(n > this->attcap) {
+    cap = this->attcap ? 2 * this->attcap : 8;
+    while(cap < n) {
+      cap *= 2;
+    }
+    a = realloc(this->atts, cap * sizeof(*a));
+    if(!a) {
+      abort();
+    }
+    this->atts = a;
+    this->attcap = cap;
+  }
+  return this->atts;
+}
+
+static void handle_start (struct processor *this,
+			  const XML_Char *name,
+			  const XML_Char **atts)
+{
+  struct tml_att *a;
+  size_t len;
+  int i, n;
+  if(this->replay) {
+    return;
+  }
+  for(n = 0; atts[2 * n]; n++) {
+  }
+  a = atts_grow(this, n);
+  for(i = 0; i < n; i++) {
+    a[i].name = atts[2 * i];
+    a[i].namelen = strlen(atts[2 * i]);
+    a[i].value = atts[2 * i + 1];
+    a[i].len = strlen(atts[2 * i + 1]);
+  }
+  len = strlen(name);
+  event_start(this, element_lookup(name, len), name, len, a, n,
+	      this->scan.pos + XML_GetCurrentByteIndex(this->xml));
+}
+
+static void handle_end (struct processor *this,
+			const XML_Char *name)
+{
+  size_t len;
+  if(this->replay) {
+    return;
+  }
+  len = strlen(name);
+  event_end(this, element_lookup(name, len), name, len,
+	    this->scan.pos + XML_GetCurrentByteIndex(this->xml));
+}
+
+static void handle_cdata (struct processor *this,
+			  const XML_Char *s, int len)
+{
+  if(this->replay) {
+    return;
+  }
+  event_text(this, s, len,
+	     this->scan.pos + XML_GetCurrentByteIndex(this->xml));
+}
+
+static int init_term(struct processor *this)
+{
+  int res, err, fd = this->ofd;
+
+  if(isatty(fd) != 1) {
+    fd = -1;
+  }
+
+  res = setupterm(this->term, fd, &err);
+  if(res != OK) {
+    fprintf(stderr, "Error initializing terminal\n");
+    return 1;
+  }
+
+  this->termw = columns;
+
+  if(this->rawtty && fd > 0) {
+    cfmakeraw(&this->our_termios);
+
+    res = tcgetattr(fd, &this->old_termios);
+    if(res == -1) {
+      perror("tcgetattr");
+      return 1;
+    }
+
+    res = tcsetattr(fd, 0, &this->our_termios);
+    if(res == -1) {
+      perror("tcsetattr");
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static struct cap caps_add(struct termcaps *caps, const char *str)
+{
+  struct cap cap = { 0, 0 };
+  size_t len;
+  char *n;
+
+  if(!str) {
+    return cap;
+  }
+  len = strlen(str);
+  if(caps->poollen + len > caps->poolcap) {
+    caps->poolcap = 2 * (caps->poolcap + len);
+    n = realloc(caps->pool, caps->poolcap);
+    if(!n) {
+      abort();
+    }
+    caps->pool = n;
+  }
+  memcpy(caps->pool + caps->poollen, str, len);
+  cap.off = caps->poollen;
+  cap.len = len;
+  caps->poollen += len;
+  return cap;
+}
+
+#define caps_parm(caps, parm, ...)					\
+  ((parm) ? (caps->tiparms++,						\
+	     caps_add(caps, tiparm(parm, ##__VA_ARGS__)))			\
+   : (struct cap){ 0, 0 })
+
+/* xterm defaults for the basic colors */
+static const unsigned char basic_rgb[16][3] = {
+  {   0,   0,   0 }, { 205,   0,   0 }, {   0, 205,   0 }, { 205, 205,   0 },
+  {   0,   0, 238 }, { 205,   0, 205 }, {   0, 205, 205 }, { 229, 229, 229 },
+  { 127, 127, 127 }, { 255,   0,   0 }, {   0, 255,   0 }, { 255, 255,   0 },
+  {  92,  92, 255 }, { 255,   0, 255 }, {   0, 255, 255 }, { 255, 255, 255 },
+};
+
+/* levels of the 4x4x4 cube and gray ramp of 88 color terminals */
+static const unsigned char cube88_levels[4] = { 0, 139, 205, 255 };
+static const unsigned char gray88_levels[8] = {
+  46, 92, 113, 139, 162, 185, 208, 231
+};
+
+/* color I of a palette of COLORS entries */
+static void palette_rgb(int i, int colors, int *rgb)
+{
+  if(i < 16) {
+    rgb[0] = basic_rgb[i][0];
+    rgb[1] = basic_rgb[i][1];
+    rgb[2] = basic_rgb[i][2];
+  } else if(colors == 88 && i < 80) {
+    i -= 16;
+    rgb[0] = cube88_levels[i / 16];
+    rgb[1] = cube88_levels[i / 4 % 4];
+    rgb[2] = cube88_levels[i % 4];
+  } else if(colors == 88) {
+    rgb[0] = rgb[1] = rgb[2] = gray88_levels[i - 80];
+  } else if(i < 232) {
+    i -= 16;
+    rgb[0] = cube_levels[i / 36];
+    rgb[1] = cube_levels[i / 6 % 6];
+    rgb[2] = cube_levels[i % 6];
+  } else {
+    rgb[0] = rgb[1] = rgb[2] = 8 + 10 * (i - 232);
+  }
+}
+
+/* map the 256 color palette onto the colors of the terminal */
+static void init_color_map(struct termcaps *caps)
+{
+  int i, j, d, best, bestd, src[3], dst[3];
+
+  for(i = 0; i < CAPS_COLORS; i++) {
+    if(i < caps->colors) {
+      caps->map[i] = i;
+      continue;
+    }
+    best = -1;
+    bestd = 0;
+    palette_rgb(i, CAPS_COLORS, src);
+    for(j = 0; j < caps->colors; j++) {
+      palette_rgb(j, caps->colors, dst);
+      d = rgb_distance(src[0], src[1], src[2], dst[0], dst[1], dst[2]);
+      if(best < 0 || d < bestd) {
+	best = j;
+	bestd = d;
+      }
+    }
+    caps->map[i] = best;
+  }
+}
+
+/* check whether CAP resets all attributes */
+static int cap_resets(struct termcaps *caps, struct cap cap)
+{
+  const char *p = caps->pool + cap.off;
+  if(cap.len == caps->sgr0.len
+     && memcmp(p, caps->pool + caps->sgr0.off, cap.len) == 0) {
+    return 1;
+  }
+  return (cap.len >= 3 && memcmp(p, "\033[m", 3) == 0)
+    || (cap.len >= 4 && memcmp(p, "\033[0m", 4) == 0);
+}
+
+/* choose how to build every flag combination from scratch */
+static void init_cost(struct termcaps *caps)
+{
+  size_t len;
+  style_t s;
+  int i, f;
+
+  for(i = 0; i < STYLE_NFLAGS; i++) {
+    if(caps->enter[i].len || (caps->has_sgr && ((1 << i) & STYLE_SGR))) {
+      caps->shown |= 1 << i;
+    }
+    if(!caps->enter[i].len) {
+      caps->noenter |= 1 << i;
+    }
+    /* only exits that are there and not a full reset, as on vt100,
+       end a single mode */
+    if(!caps->exit[i].len || cap_resets(caps, caps->exit[i])) {
+      caps->noexit |= 1 << i;
+    }
+  }
+  /* modes that never show need neither */
+  caps->noenter &= caps->shown;
+  caps->noexit &= caps->shown;
+
+  for(f = 0; f < SGR_COMBOS; f++) {
+    s = ((f & SGR_STANDOUT) ? STYLE_STANDOUT : 0) |
+      ((f & SGR_UNDERLINE) ? STYLE_U : 0) |
+      ((f & SGR_REVERSE) ? STYLE_REVERSE : 0) |
+      ((f & SGR_BLINK) ? STYLE_BLINK : 0) |
+      ((f & SGR_BOLD) ? STYLE_B : 0);
+    len = SEQ_NONE;
+    if(caps->sgr0.len) {
+      len = caps->sgr0.len;
+      for(i = 0; i < STYLE_NFLAGS; i++) {
+	if(s & (1 << i)) {
+	  len += caps->enter[i].len;
+	}
+      }
+    }
+    caps->rebuild_sgr[f] = caps->has_sgr && caps->sgr[f].len < len;
+    caps->rebuild_len[f] = caps->rebuild_sgr[f] ? caps->sgr[f].len : len;
+  }
+}
+
+static int init_caps(struct processor *this)
+{
+  struct termcaps *caps;
+  int i;
+
+  caps = calloc(1, sizeof(*caps));
+  if(!caps) {
+    fprintf(stderr, "Error allocating capability table\n");
+    return 1;
+  }
+
+  caps->sgr0 = caps_parm(caps, exit_attribute_mode);
+  caps->el = caps_parm(caps, clr_eol);
+  caps->bce = back_color_erase;
+
+  caps->has_sgr = set_attributes != NULL;
+  for(i = 0; caps->has_sgr && i < SGR_COMBOS; i++) {
+    caps->sgr[i] = caps_parm(caps, set_attributes,
+			     !!(i & SGR_STANDOUT), !!(i & SGR_UNDERLINE),
+			     !!(i & SGR_REVERSE), !!(i & SGR_BLINK), 0,
+			     !!(i & SGR_BOLD), 0, 0, 0);
+  }
+
+  caps->enter[0] = caps_parm(caps, enter_bold_mode);
+  caps->enter[1] = caps_parm(caps, enter_italics_mode);
+  caps->exit[1] = caps_parm(caps, exit_italics_mode);
+  caps->enter[2] = caps_parm(caps, enter_underline_mode);
+  caps->exit[2] = caps_parm(caps, exit_underline_mode);
+  caps->enter[3] = caps_parm(caps, enter_subscript_mode);
+  caps->exit[3] = caps_parm(caps, exit_subscript_mode);
+  caps->enter[4] = caps_parm(caps, enter_superscript_mode);
+  caps->exit[4] = caps_parm(caps, exit_superscript_mode);
+  caps->enter[5] = caps_parm(caps, enter_blink_mode);
+  caps->enter[6] = caps_parm(caps, enter_reverse_mode);
+  caps->enter[7] = caps_parm(caps, enter_standout_mode);
+  caps->exit[7] = caps_parm(caps, exit_standout_mode);
+  caps->op = caps_parm(caps, orig_pair);
+  init_cost(caps);
+
+  /* expand every color the terminal supports */
+  caps->colors = max_colors;
+  if(caps->colors < 0) {
+    caps->colors = 0;
+  }
+  if(caps->colors > CAPS_COLORS) {
+    caps->colors = CAPS_COLORS;
+  }
+  for(i = 0; i < caps->colors; i++) {
+    caps->fg[i] = caps_parm(caps, set_a_foreground, i);
+    caps->bg[i] = caps_parm(caps, set_a_background, i);
+  }
+  init_color_map(caps);
+
+  this->caps = caps;
+  this->stats.tiparms += caps->tiparms;
+
+  return 0;
+}
+
+static int fini_caps(struct processor *this)
+{
+  if(this->capsshared) {
+    this->caps = NULL;
+    this->capsshared = 0;
+  }
+  if(this->caps) {
+    free(this->caps->pool);
+    free(this->caps);
+    this->caps = NULL;
+  }
+  return 0;
+}
+
+static int fini_term(struct processor *this)
+{
+  int res, fd = this->ofd;
+
+  if(isatty(fd) != 1) {
+    fd = -1;
+  }
+
+  if(this->rawtty && fd > 0) {
+    res = tcsetattr(fd, 0, &this->old_termios);
+    if(res == -1) {
+      perror("tcsetattr");
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static int init_output(struct processor *this)
+{
+  /* pick a policy if none was requested */
+  if(this->unbuffered) {
+    this->flush = FLUSH_EVENT;
+  }
+  if(this->flush < 0) {
+    this->flush = (isatty(this->ofd) == 1) ? FLUSH_LINE : FLUSH_IDLE;
+  }
+
+  /* the size threshold doubles as buffer size */
+  this->ocap = OBUF_SIZE;
+  if(this->flush == FLUSH_SIZE && this->flushsize > 0) {
+    this->ocap = this->flushsize;
+  }
+  this->olen = 0;
+  this->oqueued = 0;
+  this->obuf = malloc(this->ocap);
+  if(!this->obuf) {
+    fprintf(stderr, "Error allocating output buffer\n");
+    return 1;
+  }
+
+  return 0;
+}
+
+static int fini_output(struct processor *this)
+{
+  emit_flush(this);
+  free(this->obuf);
+  this->obuf = NULL;
+  this->ocap = 0;
+  return 0;
+}
+
+static void xml_handlers(struct processor *this)
+{
+  XML_SetUserData(this->xml, this);
+  XML_SetElementHandler(this->xml,
+			(XML_StartElementHandler)&handle_start,
+			(XML_EndElementHandler)&handle_end);
+  XML_SetCharacterDataHandler(this->xml,
+			      (XML_CharacterDataHandler)&handle_cdata);
+}
+
+static int init_xml(struct processor *this)
+{
+  this->xml = XML_ParserCreate(NULL);
+  if(!this->xml) {
+    fprintf(stderr, "Error initializing expat\n");
+    return 1;
+  }
+  xml_handlers(this);
+  this->xmlused = 0;
+
+  return 0;
+}
+
+static int fini_xml(struct processor *this)
+{
+  if(this->xml) {
+    XML_ParserFree(this->xml);
+    this->xml = NULL;
+  }
+  free(this->scan.stack);
+  free(this->scan.carry);
+  free(this->atts);
+  memset(&this->scan, 0, sizeof(this->scan));
+  this->atts = NULL;
+  this->attcap = 0;
+  return 0;
+}
+
+/* built-in tokenizer for the markup subset: known elements with
+   quoted attributes, text, character references and comments. It
+   hands the rest of the document to expat at anything else, which
+   includes every error, so expat still has the last word on what
+   is well-formed. */
+
+/* classes of bytes in text */
+#define TC_PLAIN   0
+#define TC_LT      1
+#define TC_AMP     2
+#define TC_CR      3
+#define TC_BRACKET 4
+#define TC_HIGH    5
+#define TC_BAD     6
+
+static const unsigned char tclass[256] = {
+  [0x00 ... 0x08] = TC_BAD,
+  [0x0b ... 0x0c] = TC_BAD,
+  ['\r'] = TC_CR,
+  [0x0e ... 0x1f] = TC_BAD,
+  ['<'] = TC_LT,
+  ['&'] = TC_AMP,
+  [']'] = TC_BRACKET,
+  [0x80 ... 0xff] = TC_HIGH,
+};
+
+/* longest character reference we decode */
+#define SCAN_REF 12
+
+static inline int scan_space(char c)
+{
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static inline int scan_namestart(char c)
+{
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+static inline int scan_namechar(char c)
+{
+  return scan_namestart(c) || (c >= '0' && c <= '9') || c == '-' || c == '.';
+}
+
+/* length of the UTF-8 character at P if it is one XML allows,
+   0 if it is not and -1 if it is cut off */
+static int scan_utf8(const unsigned char *p, size_t len)
+{
+  uint32_t c;
+  int n, i;
+
+  n = p[0] < 0xc2 ? 0 : p[0] < 0xe0 ? 2 : p[0] < 0xf0 ? 3 : p[0] < 0xf5 ? 4 : 0;
+  if(!n) {
+    return 0;
+  }
+  if(len < (size_t)n) {
+    return -1;
+  }
+  c = p[0] & (0x7f >> n);
+  for(i = 1; i < n; i++) {
+    if((p[i] & 0xc0) != 0x80) {
+      return 0;
+    }
+    c = (c << 6) | (p[i] & 0x3f);
+  }
+  /* overlong forms, surrogates, beyond unicode and non-characters */
+  if((n == 3 && c < 0x800) || (n == 4 && (c < 0x10000 || c > 0x10ffff))
+     || (c >= 0xd800 && c <= 0xdfff) || c == 0xfffe || c == 0xffff) {
+    return 0;
+  }
+  return n;
+}
+
+/* decode the character reference at P, which starts with "&" */
+static size_t scan_ref(struct processor *this, const char *p, size_t len)
+{
+  struct tml_scanner *s = &this->scan;
+  char out[4];
+  const char *v;
+  uint32_t c = 0;
+  size_t i, j, n = 0;
+  int d;
+
+  for(i = 1; i < len && i < SCAN_REF && p[i] != ';'; i++) {
+  }
+  if(i == len && i < SCAN_REF) {
+    s->more = 1;
+    return 0;
+  }
+  if(i == SCAN_REF || p[i] != ';') {
+    s->expat = 1;
+    return 0;
+  }
+
+  v = p + 1;
+  if(i == 3 && memcmp(v, "lt", 2) == 0) {
+    out[n++] = '<';
+  } else if(i == 3 && memcmp(v, "gt", 2) == 0) {
+    out[n++] = '>';
+  } else if(i == 4 && memcmp(v, "amp", 3) == 0) {
+    out[n++] = '&';
+  } else if(i == 5 && memcmp(v, "quot", 4) == 0) {
+    out[n++] = '"';
+  } else if(i == 5 && memcmp(v, "apos", 4) == 0) {
+    out[n++] = '\'';
+  } else if(i > 2 && v[0] == '#') {
+    /* numeric references, in decimal or hex */
+    j = (v[1] == 'x') ? 2 : 1;
+    if(j + 1 >= i) {
+      s->expat = 1;
+      return 0;
+    }
+    for(; j < i - 1; j++) {
+      d = v[1] == 'x' ? hex_digit(v[j]) : (v[j] >= '0' && v[j] <= '9')
+	? v[j] - '0' : -1;
+      if(d < 0) {
+	s->expat = 1;
+	return 0;
+      }
+      c = c * (v[1] == 'x' ? 16 : 10) + d;
+    }
+    if(!(c == 0x9 || c == 0xa || c == 0xd || (c >= 0x20 && c <= 0xd7ff)
+	 || (c >= 0xe000 && c <= 0xfffd) || (c >= 0x10000 && c <= 0x10ffff))) {
+      s->expat = 1;
+      return 0;
+    }
+    if(c < 0x80) {
+      out[n++] = c;
+    } else if(c < 0x800) {
+      out[n++] = 0xc0 | (c >> 6);
+      out[n++] = 0x80 | (c & 0x3f);
+    } else if(c < 0x10000) {
+      out[n++] = 0xe0 | (c >> 12);
+      out[n++] = 0x80 | ((c >> 6) & 0x3f);
+      out[n++] = 0x80 | (c & 0x3f);
+    } else {
+      out[n++] = 0xf0 | (c >> 18);
+      out[n++] = 0x80 | ((c >> 12) & 0x3f);
+      out[n++] = 0x80 | ((c >> 6) & 0x3f);
+      out[n++] = 0x80 | (c & 0x3f);
+    }
+  } else {
+    /* entities would need the document type */
+    s->expat = 1;
+    return 0;
+  }
+
+  event_text(this, out, n, s->pos);
+  return i + 1;
+}
+
+/* character data up to the next tag */
+static size_t scan_text(struct processor *this, const char *p, size_t len)
+{
+  struct tml_scanner *s = &this->scan;
+  const unsigned char *u = (const unsigned char *)p;
+  size_t i = 0, start = 0, n;
+  int k;
+
+  /* only blanks around the root element */
+  if(!s->depth) {
+    while(i < len && scan_space(p[i])) {
+      i++;
+    }
+    if(i < len && p[i] != '<') {
+      s->expat = 1;
+    }
+    return i;
+  }
+
+  while(i < len) {
+    switch(tclass[u[i]]) {
+    case TC_PLAIN:
+      i++;
+      continue;
+    case TC_HIGH:
+      k = scan_utf8(u + i, len - i);
+      if(k > 0) {
+	i += k;
+	continue;
+      }
+      if(k < 0) {
+	s->more = 1;
+      } else {
+	s->expat = 1;
+      }
+      break;
+    case TC_BRACKET:
+      /* "]]>" may not appear in text */
+      n = len - i < 3 ? len - i : 3;
+      if(memcmp(p + i, "]]>", n) != 0) {
+	i++;
+	continue;
+      }
+      if(n < 3) {
+	s->more = 1;
+      } else {
+	s->expat = 1;
+      }
+      break;
+    case TC_CR:
+      /* line ends become newlines */
+      if(i + 1 == len) {
+	s->more = 1;
+	break;
+      }
+      if(i > start) {
+	event_text(this, p + start, i - start, s->pos + start);
+      }
+      if(p[i + 1] != '\n') {
+	event_text(this, "\n", 1, s->pos + i);
+      }
+      start = ++i;
+      continue;
+    case TC_AMP:
+      if(i > start) {
+	event_text(this, p + start, i - start, s->pos + start);
+      }
+      s->pos += i;
+      n = scan_ref(this, p + i, len - i);
+      s->pos -= i;
+      if(!n) {
+	return i;
+      }
+      start = i += n;
+      continue;
+    default:
+      /* tags, and control characters for expat to reject */
+      if(tclass[u[i]] == TC_BAD) {
+	s->expat = 1;
+      }
+      break;
+    }
+    break;
+  }
+
+  if(i > start) {
+    event_text(this, p + start, i - start, s->pos + start);
+  }
+  return i;
+}
+
+/* a comment, which starts with "<!--" */
+static size_t scan_comment(struct processor *this, const char *p, size_t len)
+{
+  struct tml_scanner *s = &this->scan;
+  const unsigned char *u = (const unsigned char *)p;
+  size_t i = 4;
+  int k;
+
+  while(i < len) {
+    if(p[i] == '-') {
+      if(i + 2 >= len) {
+	break;
+      }
+      if(p[i + 1] == '-') {
+	/* "--" only ends comments */
+	if(p[i + 2] != '>') {
+	  s->expat = 1;
+	  return 0;
+	}
+	return i + 3;
+      }
+      i++;
+    } else if(tclass[u[i]] == TC_HIGH) {
+      k = scan_utf8(u + i, len - i);
+      if(k <= 0) {
+	if(k == 0) {
+	  s->expat = 1;
+	  return 0;
+	}
+	break;
+      }
+      i += k;
+    } else if(tclass[u[i]] == TC_BAD) {
+      s->expat = 1;
+      return 0;
+    } else {
+      i++;
+    }
+  }
+  s->more = 1;
+  return 0;
+}
+
+/* an end tag, which starts with "</" */
+static size_t scan_end(struct processor *this, const char *p, size_t len)
+{
+  struct tml_scanner *s = &this->scan;
+  size_t i = 2, k;
+  int id;
+
+  while(i < len && scan_namechar(p[i])) {
+    i++;
+  }
+  for(k = i; k < len && scan_space(p[k]); k++) {
+  }
+  if(k == len) {
+    s->more = 1;
+    return 0;
+  }
+  if(i == 2 || !scan_namestart(p[2]) || p[k] != '>' || !s->depth) {
+    s->expat = 1;
+    return 0;
+  }
+  id = s->stack[s->depth - 1];
+  if(strlen(elements[id].name) != i - 2
+     || memcmp(p + 2, elements[id].name, i - 2) != 0) {
+    s->expat = 1;
+    return 0;
+  }
+
+  s->depth--;
+  if(!s->depth) {
+    s->done = 1;
+  }
+  event_end(this, id, p + 2, i - 2, s->pos);
+  return k + 1;
+}
+
+/* a start tag or empty element, which starts with "<" and a name */
+static size_t scan_start(struct processor *this, const char *p, size_t len)
+{
+  struct tml_scanner *s = &this->scan;
+  const unsigned char *u = (const unsigned char *)p;
+  struct tml_att *a;
+  size_t i = 1, j, k, end;
+  int id, n = 0, empty = 0, x;
+  unsigned char *st;
+  char q;
+
+  while(i < len && scan_namechar(p[i])) {
+    i++;
+  }
+  if(i == len) {
+    s->more = 1;
+    return 0;
+  }
+  id = element_lookup(p + 1, i - 1);
+  /* unknown elements, prefixes, and a second root are for expat */
+  if(!scan_namestart(p[1]) || id == ELEM_UNKNOWN || s->done
+     || (p[i] != '>' && p[i] != '/' && !scan_space(p[i]))) {
+    s->expat = 1;
+    return 0;
+  }
+
+  while(1) {
+    for(j = i; j < len && scan_space(p[j]); j++) {
+    }
+    if(j == len) {
+      goto more;
+    }
+    if(p[j] == '>') {
+      end = j + 1;
+      break;
+    }
+    if(p[j] == '/') {
+      if(j + 1 == len) {
+	goto more;
+      }
+      if(p[j + 1] != '>') {
+	goto expat;
+      }
+      end = j + 2;
+      empty = 1;
+      break;
+    }
+    if(j == i || !scan_namestart(p[j])) {
+      goto expat;
+    }
+
+    /* name = "value" */
+    for(k = j; k < len && scan_namechar(p[k]); k++) {
+    }
+    a = atts_grow(this, n + 1);
+    a[n].name = p + j;
+    a[n].namelen = k - j;
+    while(k < len && scan_space(p[k])) {
+      k++;
+    }
+    if(k == len) {
+      goto more;
+    }
+    if(p[k++] != '=') {
+      goto expat;
+    }
+    while(k < len && scan_space(p[k])) {
+      k++;
+    }
+    if(k == len) {
+      goto more;
+    }
+    q = p[k++];
+    if(q != '"' && q != '\'') {
+      goto expat;
+    }
+    a[n].value = p + k;
+    while(k < len && p[k] != q) {
+      /* values that need normalizing go to expat */
+      if(tclass[u[k]] == TC_HIGH) {
+	x = scan_utf8(u + k, len - k);
+	if(x < 0) {
+	  goto more;
+	}
+	if(x == 0) {
+	  goto expat;
+	}
+	k += x;
+	continue;
+      }
+      if(tclass[u[k]] != TC_PLAIN && tclass[u[k]] != TC_BRACKET) {
+	goto expat;
+      }
+      if(p[k] == '\t' || p[k] == '\n') {
+	goto expat;
+      }
+      k++;
+    }
+    if(k == len) {
+      goto more;
+    }
+    a[n].len = p + k - a[n].value;
+    for(x = 0; x < n; x++) {
+      if(a[x].namelen == a[n].namelen
+	 && memcmp(a[x].name, a[n].name, a[n].namelen) == 0) {
+	goto expat;
+      }
+    }
+    n++;
+    i = k + 1;
+  }
+
+  if(s->depth == s->stackcap) {
+    s->stackcap = s->stackcap ? 2 * s->stackcap : 64;
+    st = realloc(s->stack, s->stackcap);
+    if(!st) {
+      abort();
+    }
+    s->stack = st;
+  }
+  s->stack[s->depth++] = id;
+  event_start(this, id, p + 1, strlen(elements[id].name), this->atts, n,
+	      s->pos);
+  if(empty) {
+    s->depth--;
+    if(!s->depth) {
+      s->done = 1;
+    }
+    event_end(this, id, p + 1, strlen(elements[id].name), s->pos);
+  }
+  return end;
+
+ more:
+  s->more = 1;
+  return 0;
+ expat:
+  s->expat = 1;
+  return 0;
+}
+
+/* tokenize BUF, returns how much of it was handled */
+static size_t scan_chunk(struct processor *this,
+			 const char *buf, size_t len, int final)
+{
+  struct tml_scanner *s = &this->scan;
+  const char *p = buf, *e = buf + len;
+  size_t n;
+
+  s->more = 0;
+  while(p < e && !s->more && !s->expat) {
+    if(*p != '<') {
+      n = scan_text(this, p, e - p);
+    } else if(e - p < 4) {
+      /* enough to tell comments from tags */
+      n = 0;
+      if(e - p < 2 || (p[1] == '!' && memcmp(p, "<!--", e - p) == 0)) {
+	s->more = 1;
+      } else if(p[1] == '/') {
+	n = scan_end(this, p, e - p);
+      } else if(p[1] == '!' || p[1] == '?') {
+	s->expat = 1;
+      } else {
+	n = scan_start(this, p, e - p);
+      }
+    } else if(p[1] == '/') {
+      n = scan_end(this, p, e - p);
+    } else if(p[1] == '!') {
+      if(memcmp(p, "<!--", 4) == 0) {
+	n = scan_comment(this, p, e - p);
+      } else {
+	/* sections and declarations */
+	n = 0;
+	s->expat = 1;
+      }
+    } else if(p[1] == '?') {
+      /* processing instructions, and the xml declaration */
+      n = 0;
+      s->expat = 1;
+    } else {
+      n = scan_start(this, p, e - p);
+    }
+    p += n;
+    s->pos += n;
+  }
+
+  /* a document has to end with its root element */
+  if(final && (s->more || (!s->expat && !s->done))) {
+    s->expat = 1;
+  }
+  return p - buf;
+}
+
+/* keep LEN bytes at BUF for the next chunk */
+static void scan_keep(struct tml_scanner *s, const char *buf, size_t len)
+{
+  char *n;
+  if(len == 0) {
+    return;
+  }
+  if(s->carrylen + len > s->carrycap) {
+    s->carrycap = 2 * (s->carrylen + len);
+    n = realloc(s->carry, s->carrycap);
+    if(!n) {
+      abort();
+    }
+    s->carry = n;
+  }
+  memcpy(s->carry + s->carrylen, buf, len);
+  s->carrylen += len;
+}
+
+/* parse with expat, FINAL if it is the last chunk */
+static int xml_feed(struct processor *this,
+		    const char *buf, size_t len, int final)
+{
+  enum XML_Error xe;
+  if(XML_Parse(this->xml, buf, len, final) != XML_STATUS_OK) {
+    xe = XML_GetErrorCode(this->xml);
+    fprintf(stderr, "XML error: %s\n", XML_ErrorString(xe));
+    return 1;
+  }
+  return 0;
+}
+
+/* let expat take over, after showing it what has been parsed */
+static int scan_handover(struct processor *this)
+{
+  struct tml_scanner *s = &this->scan;
+  const char *name;
+  size_t n = 0;
+  int i, res = 0;
+
+  s->expat = 1;
+  if(this->xmlused && !XML_ParserReset(this->xml, NULL)) {
+    fprintf(stderr, "Error resetting expat\n");
+    return 1;
+  }
+  xml_handlers(this);
+  this->xmlused = 1;
+
+  /* open elements, or a closed root, with events ignored. a
+     blank keeps a declaration that is not at the start invalid. */
+  this->replay = 1;
+  if(s->done) {
+    res = xml_feed(this, "<tml/>", 6, 0);
+    n += 6;
+  } else if(!s->depth && s->pos) {
+    res = xml_feed(this, " ", 1, 0);
+    n += 1;
+  }
+  for(i = 0; i < s->depth && !res; i++) {
+    name = elements[s->stack[i]].name;
+    res = xml_feed(this, "<", 1, 0) || xml_feed(this, name, strlen(name), 0)
+      || xml_feed(this, ">", 1, 0);
+    n += strlen(name) + 2;
+  }
+  this->replay = 0;
+
+  /* expat counts offsets from there */
+  s->pos -= n;
+  return res;
+}
+
+/* tokenize a chunk, handing over to expat where needed */
+static int scan_feed(struct processor *this,
+		     const char *buf, size_t len, int final)
+{
+  struct tml_scanner *s = &this->scan;
+  const char *gt;
+  size_t off = 0, used = 0, old, n;
+
+  /* complete the token left over from the last chunk */
+  while(s->carrylen) {
+    if(s->carry[0] == '<') {
+      gt = off < len ? memchr(buf + off, '>', len - off) : NULL;
+      n = gt ? (size_t)(gt - buf - off + 1) : len - off;
+    } else {
+      n = len - off < SCAN_REF ? len - off : SCAN_REF;
+    }
+    old = s->carrylen;
+    scan_keep(s, buf + off, n);
+    off += n;
+    used = scan_chunk(this, s->carry, s->carrylen, final && off == len);
+    if(s->expat) {
+      break;
+    }
+    if(used >= old) {
+      /* continue in the chunk itself */
+      off -= s->carrylen - used;
+      s->carrylen = 0;
+      break;
+    }
+    memmove(s->carry, s->carry + used, s->carrylen - used);
+    s->carrylen -= used;
+    if(off == len) {
+      return 0;
+    }
+  }
+
+  if(!s->expat) {
+    off += scan_chunk(this, buf + off, len - off, final);
+    if(!s->expat) {
+      scan_keep(s, buf + off, len - off);
+      return 0;
+    }
+    used = s->carrylen;
+  }
+
+  /* expat gets the rest */
+  if(scan_handover(this)) {
+    return 1;
+  }
+  if(used < s->carrylen
+     && xml_feed(this, s->carry + used, s->carrylen - used, 0)) {
+    return 1;
+  }
+  s->carrylen = 0;
+  return xml_feed(this, buf + off, len - off, final);
+}
+
+static int fini_vars(struct processor *this)
+{
+  int i;
+  for(i = 0; i < this->nvars; i++) {
+    free(this->vars[i].name);
+    free(this->vars[i].value);
+  }
+  free(this->vars);
+  this->vars = NULL;
+  this->nvars = 0;
+  this->varcap = 0;
+  return 0;
+}
+
+int processor_init(struct processor *this) {
+  bzero(this, sizeof(*this));
+  this->term = getenv("TERM");
+  this->termw = -1;
+  this->ifd = 0;
+  this->ofd = 1;
+  this->ow = -1;
+  this->flush = -1;
+  this->flushsize = OBUF_SIZE;
+  this->flushidle = IDLE_TIMEOUT;
+  this->attrmax = ATTR_DEPTH;
+  return 0;
+}
+
+int processor_setup(struct processor *this)
+{
+  int res;
+
+  /* pick the text scanner */
+  scan_select();
+
+  /* initialize output buffer */
+  res = init_output(this);
+  if(res) {
+    goto err_init_output;
+  }
+
+  /* initialize xml parser */
+  res = init_xml(this);
+  if(res) {
+    fprintf(stderr, "Error in XML setup\n");
+    goto err_init_xml;
+  }
+
+  /* initialize terminal */
+  res = init_term(this);
+  if(res) {
+    fprintf(stderr, "Error in terminal setup\n");
+    goto err_init_term;
+  }
+
+  /* expand terminal capabilities */
+  res = init_caps(this);
+  if(res) {
+    goto err_init_caps;
+  }
+
+  /* tweak terminal size for non-raw mode */
+  if((isatty(this->ofd) == 1) && !this->rawtty) {
+    this->termw -= 1;
+  }
+
+  if(this->debug)
+    fprintf(stderr, "Terminal type: %s\n", this->term);
+  if(this->debug)
+    fprintf(stderr, "Terminal width: %d\n", this->termw);
+
+  /* determine output width */
+  if(this->ow <= 0) {
+    this->ow = this->termw;
+  }
+  if(this->ow <= 0) {
+    this->ow = 80;
+  }
+
+  /* erase instead of padding when that covers the same columns */
+  this->eolfill = this->caps->bce && this->caps->el.len
+    && isatty(this->ofd) == 1 && this->ow >= this->termw;
+
+  if(this->debug)
+    fprintf(stderr, "Output width: %d\n", this->ow);
+
+  return 0;
+
+ err_init_caps:
+  fini_term(this);
+ err_init_term:
+  fini_xml(this);
+ err_init_xml:
+  fini_output(this);
+ err_init_output:
+  return 1;
+}
+
+int processor_setup_shared(struct processor *this,
+			   const struct processor *shared)
+{
+  int res;
+
+  /* initialize output buffer */
+  res = init_output(this);
+  if(res) {
+    goto err_init_output;
+  }
+
+  /* initialize xml parser */
+  res = init_xml(this);
+  if(res) {
+    fprintf(stderr, "Error in XML setup\n");
+    goto err_init_xml;
+  }
+
+  /* capabilities are never modified after setup */
+  this->term = shared->term;
+  this->termw = shared->termw;
+  this->caps = shared->caps;
+  this->capsshared = 1;
+
+  if(this->ow <= 0) {
+    this->ow = shared->ow;
+  }
+  /* erasing covers the same columns as long as the width is the same */
+  this->eolfill = shared->eolfill && this->ow == shared->ow;
+
+  return 0;
+
+ err_init_xml:
+  fini_output(this);
+ err_init_output:
+  return 1;
+}
+
+int processor_fini(struct processor *this)
+{
+  int res, ret = 0;
+
+  res = processor_pipeline_stop(this);
+  if(res) {
+    fprintf(stderr, "Error stopping pipeline\n");
+    ret = 1;
+  }
+
+  res = fini_attr(this);
+  if(res) {
+    fprintf(stderr, "Error finalizing attributes\n");
+    ret = 1;
+  }
+  res = fini_vars(this);
+  if(res) {
+    fprintf(stderr, "Error finalizing variables\n");
+    ret = 1;
+  }
+  res = fini_caps(this);
+  if(res) {
+    fprintf(stderr, "Error finalizing capabilities\n");
+    ret = 1;
+  }
+  res = fini_term(this);
+  if(res) {
+    fprintf(stderr, "Error finalizing terminal\n");
+    ret = 1;
+  }
+  res = fini_xml(this);
+  if(res) {
+    fprintf(stderr, "Error finalizing parser\n");
+    ret = 1;
+  }
+  res = fini_output(this);
+  if(res) {
+    fprintf(stderr, "Error finalizing output\n");
+    ret = 1;
+  }
+
+  return ret;
+}
+
+/* parse a chunk of markup, FINAL if it is the last */
+static int parse_feed(struct processor *this,
+		      const char *buf, size_t len, int final)
+{
+  int res, phase = stats_phase(this, PHASE_PARSE);
+  if(this->scan.expat) {
+    res = xml_feed(this, buf, len, final);
+  } else {
+    res = scan_feed(this, buf, len, final);
+  }
+  stats_phase(this, phase);
+  return res;
+}
+
+int processor_feed(struct processor *this, const char *buf, size_t len)
+{
+  struct tml_pipeline *p = this->pipeline;
+  int res;
+
+  if(p) {
+    p->parser.stats.ibytes += len;
+    res = parse_feed(&p->parser, buf, len, 0);
+    pipe_publish(p);
+    return res;
+  }
+  this->stats.ibytes += len;
+  return parse_feed(this, buf, len, 0);
+}
+
+/* prepare the parser for another document */
+static int parse_begin(struct processor *this)
+{
+  struct tml_scanner *s = &this->scan;
+
+  /* expat is only reset if it gets used */
+  s->expat = 0;
+  s->more = 0;
+  s->depth = 0;
+  s->done = 0;
+  s->pos = 0;
+  s->carrylen = 0;
+
+  /* wrap body text */
+  if(this->body) {
+    return parse_feed(this, "<tml>", 5, 0);
+  }
+
+  return 0;
+}
+
+static int parse_end(struct processor *this)
+{
+  if(this->body) {
+    if(parse_feed(this, "</tml>", 6, 0)) {
+      return 1;
+    }
+  }
+
+  return parse_feed(this, NULL, 0, 1);
+}
+
+static void document_begin(struct processor *this)
+{
+  struct attributes *iattr;
+
+  /* reset document state */
+  this->stats.documents++;
+  this->ol = 0;
+  this->oc = 0;
+  this->attrn = 0;
+  this->attrover = 0;
+  this->tstyle = 0;
+
+  /* prepare initial attributes */
+  iattr = attr_push(this);
+  attr_zero(iattr);
+}
+
+static void document_end(struct processor *this)
+{
+  /* finish attributes */
+  attr_pop(this);
+
+  /* emit final newline */
+  if(this->oc > 0) {
+    emit_newline(this);
+  }
+
+  /* flush output */
+  emit_sync(this, FLUSH_DOCUMENT);
+}
+
+/* pass the records read so far back to the producer */
+static void pipe_release(struct tml_pipeline *p)
+{
+  if(p->rpos != p->tail) {
+    __atomic_store_n(&p->tail, p->rpos, __ATOMIC_SEQ_CST);
+    pipe_wake(p, PIPE_WAIT_ROOM);
+  }
+}
+
+/* sleep until the producer publishes, flushing if that takes
+   longer than the idle timeout, returns the new head */
+static uint64_t pipe_idle(struct processor *this, struct tml_pipeline *p)
+{
+  struct timespec ts;
+  uint64_t head;
+  int idle, res = 0;
+
+  pipe_release(p);
+  idle = this->flush == FLUSH_IDLE && this->olen && !this->omem;
+  if(idle) {
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += this->flushidle / 1000;
+    ts.tv_nsec += (long)(this->flushidle % 1000) * 1000000;
+    if(ts.tv_nsec >= 1000000000) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
+  }
+
+  pthread_mutex_lock(&p->lock);
+  __atomic_fetch_or(&p->waiting, PIPE_WAIT_DATA, __ATOMIC_SEQ_CST);
+  while((head = __atomic_load_n(&p->head, __ATOMIC_SEQ_CST)) == p->rpos
+	&& res != ETIMEDOUT) {
+    if(idle) {
+      res = pthread_cond_timedwait(&p->wake, &p->lock, &ts);
+    } else {
+      pthread_cond_wait(&p->wake, &p->lock);
+    }
+  }
+  __atomic_fetch_and(&p->waiting, ~PIPE_WAIT_DATA, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&p->lock);
+
+  if(head == p->rpos) {
+    emit_flush(this);
+  }
+  return head;
+}
+
+/* emitter thread, renders records until told to quit */
+static void *pipe_emitter(void *arg)
+{
+  struct processor *this = arg;
+  struct tml_pipeline *p = this->pipeline;
+  const struct pipe_rec *r;
+  struct pipe_att pa;
+  struct tml_att *atts;
+  const char *q;
+  uint64_t head = p->rpos;
+  int i;
+
+  while(1) {
+    while(p->rpos == head) {
+      head = __atomic_load_n(&p->head, __ATOMIC_ACQUIRE);
+      if(p->rpos == head) {
+	head = pipe_idle(this, p);
+      }
+    }
+
+    r = (const struct pipe_rec *)(p->ring + (p->rpos & (PIPE_RING - 1)));
+    switch(r->type) {
+    case PIPE_START:
+      atts = atts_grow(this, r->natts);
+      q = (const char *)(r + 1);
+      for(i = 0; i < r->natts; i++) {
+	memcpy(&pa, q, sizeof(pa));
+	q += sizeof(pa);
+	atts[i].name = q;
+	atts[i].namelen = pa.namelen;
+	q += pa.namelen;
+	atts[i].value = q;
+	atts[i].len = pa.len;
+	q += pa.len;
+      }
+      event_render_start(this, r->id == 0xff ? ELEM_UNKNOWN : r->id,
+			 atts, r->natts, r->off);
+      break;
+    case PIPE_END:
+      event_render_end(this, r->id == 0xff ? ELEM_UNKNOWN : r->id, r->off);
+      break;
+    case PIPE_TEXT:
+      event_render_text(this, (const char *)(r + 1), r->len, r->off);
+      break;
+    case PIPE_BEGIN:
+      document_begin(this);
+      break;
+    case PIPE_FINISH:
+      document_end(this);
+      __atomic_fetch_add(&p->finished, 1, __ATOMIC_SEQ_CST);
+      break;
+    case PIPE_FLUSH:
+      emit_flush(this);
+      break;
+    case PIPE_SYNC:
+      emit_sync(this, r->id);
+      break;
+    case PIPE_WRITE:
+      emit_raw(this, (const char *)(r + 1), r->len);
+      break;
+    case PIPE_QUIT:
+      p->rpos += r->size;
+      pipe_release(p);
+      return NULL;
+    }
+    p->rpos += r->size;
+
+    /* documents are acknowledged right away */
+    if(p->rpos - p->tail >= PIPE_BATCH || r->type == PIPE_FINISH) {
+      pipe_release(p);
+    }
+  }
+}
+
+/* queue a record without payload and hand everything over */
+static void pipe_send(struct tml_pipeline *p, int type, int id)
+{
+  pipe_event(p, type, id, 0, NULL, 0);
+  pipe_publish(p);
+}
+
+int processor_pipeline_start(struct processor *this)
+{
+  struct tml_pipeline *p;
+  pthread_condattr_t ca;
+  int res;
+
+  if(this->pipeline) {
+    return 0;
+  }
+
+  res = posix_memalign((void **)&p, 64, sizeof(*p));
+  if(res) {
+    fprintf(stderr, "Error allocating pipeline\n");
+    goto err_alloc;
+  }
+  memset(p, 0, sizeof(*p));
+  res = posix_memalign((void **)&p->ring, 64, PIPE_RING);
+  if(res) {
+    fprintf(stderr, "Error allocating pipeline ring\n");
+    goto err_ring;
+  }
+
+  /* the parser only shares settings that affect parsing */
+  processor_init(&p->parser);
+  p->parser.body = this->body;
+  p->parser.debug = this->debug;
+  p->parser.timed = this->timed;
+  p->parser.pipeline = p;
+  res = init_xml(&p->parser);
+  if(res) {
+    fprintf(stderr, "Error in XML setup\n");
+    goto err_xml;
+  }
+
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_condattr_init(&ca);
+  pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+  pthread_cond_init(&p->wake, &ca);
+  pthread_condattr_destroy(&ca);
+
+  this->pipeline = p;
+  res = pthread_create(&p->thread, NULL, pipe_emitter, this);
+  if(res) {
+    fprintf(stderr, "Error starting emitter: %s\n", strerror(res));
+    goto err_thread;
+  }
+
+  return 0;
+
+ err_thread:
+  this->pipeline = NULL;
+  pthread_cond_destroy(&p->wake);
+  pthread_mutex_destroy(&p->lock);
+  fini_xml(&p->parser);
+ err_xml:
+  free(p->ring);
+ err_ring:
+  free(p);
+ err_alloc:
+  return 1;
+}
+
+int processor_pipeline_stop(struct processor *this)
+{
+  struct tml_pipeline *p = this->pipeline;
+
+  if(!p) {
+    return 0;
+  }
+
+  /* everything queued is rendered before the thread quits */
+  pipe_send(p, PIPE_QUIT, 0);
+  pthread_join(p->thread, NULL);
+  this->pipeline = NULL;
+
+  stats_phase(&p->parser, 0);
+  processor_stats_add(&this->stats, &p->parser.stats);
+
+  pthread_cond_destroy(&p->wake);
+  pthread_mutex_destroy(&p->lock);
+  fini_xml(&p->parser);
+  free(p->ring);
+  free(p);
+  return 0;
+}
+
+int processor_begin(struct processor *this)
+{
+  if(this->pipeline) {
+    pipe_send(this->pipeline, PIPE_BEGIN, 0);
+    return parse_begin(&this->pipeline->parser);
+  }
+  document_begin(this);
+  return parse_begin(this);
+}
+
+int processor_end(struct processor *this)
+{
+  struct tml_pipeline *p = this->pipeline;
+
+  if(p) {
+    if(parse_end(&p->parser)) {
+      return 1;
+    }
+    /* wait until the document is out */
+    p->finishing++;
+    pipe_send(p, PIPE_FINISH, 0);
+    pipe_room(p, PIPE_RING);
+    return 0;
+  }
+  if(parse_end(this)) {
+    return 1;
+  }
+  document_end(this);
+  return 0;
+}
+
+int processor_compiled(const char *buf, size_t len)
+{
+  return len >= 4 && memcmp(buf, CODE_MAGIC, 4) == 0;
+}
+
+/* whether a push of BITS under MASK keeps styles in range */
+static int code_push_valid(style_t mask, style_t bits)
+{
+  style_t fg = (style_t)STYLE_COLOR_MASK << STYLE_FG_SHIFT;
+  style_t bg = (style_t)STYLE_COLOR_MASK << STYLE_BG_SHIFT;
+
+  /* colors are replaced whole */
+  if((mask & ~(STYLE_FLAGS | fg | bg)) || (bits & ~mask)
+     || ((mask & fg) && (mask & fg) != fg)
+     || ((mask & bg) && (mask & bg) != bg)) {
+    return 0;
+  }
+  return style_fg(bits) < STYLE_COLOR_MAX && style_bg(bits) < STYLE_COLOR_MAX;
+}
+
+/* check a compiled document and read its header into H */
+static int code_check(const char *buf, size_t len, struct code_header *h)
+{
+  struct code_op op;
+  size_t i, depth = 0;
+
+  if(len < sizeof(*h) || !processor_compiled(buf, len)) {
+    fprintf(stderr, "Not a compiled document\n");
+    return 1;
+  }
+  memcpy(h, buf, sizeof(*h));
+  if(h->order != CODE_ORDER) {
+    fprintf(stderr, "Compiled document has foreign byte order\n");
+    return 1;
+  }
+  if(h->version != CODE_VERSION) {
+    fprintf(stderr, "Compiled document has version %u, expected %u\n",
+	    h->version, CODE_VERSION);
+    return 1;
+  }
+  if(h->nops > (len - sizeof(*h)) / sizeof(op)
+     || len - sizeof(*h) - h->nops * sizeof(op) != h->nstr) {
+    fprintf(stderr, "Compiled document is truncated\n");
+    return 1;
+  }
+
+  for(i = 0; i < h->nops; i++) {
+    memcpy(&op, buf + sizeof(*h) + i * sizeof(op), sizeof(op));
+    if(op.op >= OP_COUNT
+       || ((op.op == OP_TEXT || op.op == OP_VAR)
+	   && (op.a > h->nstr || op.b > h->nstr - op.a))
+       || (op.op == OP_POP && depth-- == 0)
+       || (op.op == OP_PUSH && !code_push_valid(op.a, op.b))) {
+      fprintf(stderr, "Compiled document is corrupt at op %zu\n", i);
+      return 1;
+    }
+    if(op.op == OP_PUSH) {
+      depth++;
+    }
+  }
+
+  return 0;
+}
+
+/* execute op number I of the code at OPS */
+static void code_step(struct processor *this,
+		      const char *ops, const char *str, size_t i)
+{
+  struct code_op op;
+
+  /* the code may not be aligned */
+  memcpy(&op, ops + i * sizeof(op), sizeof(op));
+  if(op.op != OP_TEXT && op.op != OP_POP) {
+    this->stats.elements++;
+  }
+  switch(op.op) {
+  case OP_PUSH:
+    render_push(this, op.a, op.b);
+    break;
+  case OP_POP:
+    render_pop(this);
+    break;
+  case OP_TEXT:
+    render_text(this, str + op.a, op.b);
+    break;
+  case OP_BR:
+    render_br(this);
+    break;
+  case OP_PARA:
+    render_para(this);
+    break;
+  case OP_VAR:
+    render_var(this, str + op.a, op.b);
+    break;
+  }
+  emit_sync(this, FLUSH_EVENT);
+}
+
+int processor_exec(struct processor *this, const char *buf, size_t len)
+{
+  struct code_header h;
+  const char *ops, *str;
+  size_t i;
+  int phase;
+
+  if(code_check(buf, len, &h)) {
+    return 1;
+  }
+  ops = buf + sizeof(h);
+  str = ops + h.nops * sizeof(struct code_op);
+  this->stats.ibytes += len;
+
+  phase = stats_phase(this, PHASE_EMIT);
+  document_begin(this);
+  for(i = 0; i < h.nops; i++) {
+    code_step(this, ops, str, i);
+  }
+  document_end(this);
+  stats_phase(this, phase);
+
+  return 0;
+}
+
+
+void processor_stats_add(struct tml_stats *to, const struct tml_stats *from)
+{
+  int i;
+  to->documents += from->documents;
+  to->ibytes += from->ibytes;
+  to->obytes += from->obytes;
+  to->escbytes += from->escbytes;
+  to->writes += from->writes;
+  to->tiparms += from->tiparms;
+  to->elements += from->elements;
+  if(from->depth > to->depth) {
+    to->depth = from->depth;
+  }
+  to->newlines += from->newlines;
+  to->wraps += from->wraps;
+  for(i = 0; i < PHASE_COUNT; i++) {
+    to->ns[i] += from->ns[i];
+  }
+}
+
+struct tml_trace *processor_trace_new(size_t records)
+{
+  struct tml_trace *t;
+  size_t n = 1;
+
+  while(n < records) {
+    n <<= 1;
+  }
+  t = calloc(1, sizeof(*t));
+  if(!t) {
+    return NULL;
+  }
+  t->recs = malloc(n * sizeof(*t->recs));
+  if(!t->recs) {
+    free(t);
+    return NULL;
+  }
+  /* fault the pages in now rather than while tracing */
+  memset(t->recs, 0, n * sizeof(*t->recs));
+  t->mask = n - 1;
+  t->tsc0 = trace_clock();
+  t->ns0 = stats_clock();
+  return t;
+}
+
+static int trace_write(int fd, const void *buf, size_t len)
+{
+  const char *p = buf;
+  ssize_t res;
+  while(len) {
+    res = write(fd, p, len);
+    if(res == -1) {
+      if(errno == EINTR) {
+	continue;
+      }
+      return 1;
+    }
+    p += res;
+    len -= res;
+  }
+  return 0;
+}
+
+int processor_trace_dump(const struct tml_trace *t, int fd, int ring)
+{
+  struct tml_trace_header h;
+  char names[256];
+  uint64_t head = t->head, first;
+  size_t n = 0, l;
+  int i;
+
+  /* element names, no allocation as this may run in a signal handler */
+  for(i = 0; i < ELEM_COUNT; i++) {
+    l = strlen(elements[i].name) + 1;
+    if(n + l > sizeof(names)) {
+      break;
+    }
+    memcpy(names + n, elements[i].name, l);
+    n += l;
+  }
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, TRACE_MAGIC, 4);
+  h.version = TRACE_VERSION;
+  h.ring = ring;
+  h.namelen = n;
+  h.nrecs = head > t->mask + 1 ? t->mask + 1 : head;
+  h.lost = head - h.nrecs;
+  h.tsc0 = t->tsc0;
+  h.ns0 = t->ns0;
+  h.tsc1 = trace_clock();
+  h.ns1 = stats_clock();
+
+  if(trace_write(fd, &h, sizeof(h)) || trace_write(fd, names, n)) {
+    return 1;
+  }
+  /* oldest records first, in up to two pieces */
+  first = (head - h.nrecs) & t->mask;
+  l = h.nrecs < t->mask + 1 - first ? h.nrecs : t->mask + 1 - first;
+  if(trace_write(fd, t->recs + first, l * sizeof(*t->recs))
+     || trace_write(fd, t->recs, (h.nrecs - l) * sizeof(*t->recs))) {
+    return 1;
+  }
+  return 0;
+}
+
+void processor_trace_free(struct tml_trace *t)
+{
+  if(t) {
+    free(t->recs);
+    free(t);
+  }
+}
+
+void processor_flush(struct processor *this)
+{
+  if(this->pipeline) {
+    pipe_send(this->pipeline, PIPE_FLUSH, 0);
+    return;
+  }
+  emit_flush(this);
+}
+
+int processor_drain(struct processor *this, int block)
+{
+  if(this->oqueued && !this->omem) {
+    emit_drain(this, this->oqueued, block);
+  }
+  return this->oqueued != 0;
+}
+
+void processor_sync(struct processor *this, enum flush_policy level)
+{
+  if(this->pipeline) {
+    pipe_send(this->pipeline, PIPE_SYNC, level);
+    return;
+  }
+  emit_sync(this, level);
+}
+
+void processor_write(struct processor *this, const char *buf, size_t len)
+{
+  if(this->pipeline) {
+    pipe_text(this->pipeline, PIPE_WRITE, buf, len, 0);
+    pipe_publish(this->pipeline);
+    return;
+  }
+  emit_raw(this, buf, len);
+}
+
+/* regular output, set aside while writing to memory */
+struct output_save {
+  char *obuf;
+  size_t olen;
+  size_t ocap;
+  size_t oqueued;
+};
+
+static void omem_enter(struct processor *this, struct tml_buffer *out,
+		       struct output_save *save)
+{
+  save->obuf = this->obuf;
+  save->olen = this->olen;
+  save->ocap = this->ocap;
+  save->oqueued = this->oqueued;
+
+  /* write straight into the caller's buffer */
+  this->omem = out;
+  this->obuf = out->data;
+  this->olen = out->len;
+  this->ocap = out->cap;
+  this->oqueued = 0;
+}
+
+static void omem_leave(struct processor *this, struct output_save *save)
+{
+  struct tml_buffer *out = this->omem;
+
+  out->data = this->obuf;
+  out->len = this->olen;
+  out->cap = this->ocap;
+
+  /* back to regular output */
+  this->omem = NULL;
+  this->obuf = save->obuf;
+  this->olen = save->olen;
+  this->ocap = save->ocap;
+  this->oqueued = save->oqueued;
+}
+
+int processor_render(struct processor *this,
+		     const char *buf, size_t len,
+		     struct tml_buffer *out)
+{
+  struct output_save save;
+  int res;
+
+  omem_enter(this, out, &save);
+
+  if(processor_compiled(buf, len)) {
+    res = processor_exec(this, buf, len);
+  } else {
+    res = processor_begin(this);
+    if(!res) {
+      res = processor_feed(this, buf, len);
+    }
+    if(!res) {
+      res = processor_end(this);
+    }
+  }
+
+  omem_leave(this, &save);
+
+  if(res) {
+    return TML_ERROR;
+  }
+  return out->lost ? TML_TRUNCATED : TML_OK;
+}
+
+int processor_compile(struct processor *this,
+		      const char *buf, size_t len,
+		      struct tml_buffer *out)
+{
+  struct compiler comp;
+  struct code_header h;
+  struct output_save save;
+  int res;
+
+  memset(&comp, 0, sizeof(comp));
+  this->comp = &comp;
+
+  res = parse_begin(this);
+  if(!res) {
+    res = processor_feed(this, buf, len);
+  }
+  if(!res) {
+    res = parse_end(this);
+  }
+  comp_text(&comp);
+  this->comp = NULL;
+
+  if(!res && (comp.nops > UINT32_MAX / sizeof(*comp.ops)
+	      || comp.strlen > UINT32_MAX)) {
+    fprintf(stderr, "Document too large to compile\n");
+    res = 1;
+  }
+
+  if(!res) {
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, CODE_MAGIC, 4);
+    h.version = CODE_VERSION;
+    h.order = CODE_ORDER;
+    h.nops = comp.nops;
+    h.nstr = comp.strlen;
+
+    omem_enter(this, out, &save);
+    emit_raw(this, (const char *)&h, sizeof(h));
+    emit_raw(this, (const char *)comp.ops, comp.nops * sizeof(*comp.ops));
+    emit_raw(this, comp.str, comp.strlen);
+    omem_leave(this, &save);
+  }
+
+  fini_compiler(&comp);
+
+  if(res) {
+    return TML_ERROR;
+  }
+  return out->lost ? TML_TRUNCATED : TML_OK;
+}
+
+/* a run of ops between variables, with its last rendering */
+struct segment {
+  size_t first;
+  size_t nops;
+  /* variable following the segment */
+  const char *var;
+  size_t varlen;
+
+  /* a rendering is cached */
+  int valid;
+  /* state the rendering started from */
+  int oc;
+  style_t tstyle;
+  int depth;
+  /* entry stack, followed by the levels pushed */
+  style_t *stack;
+  int npushed;
+  int stackcap;
+  /* output and the state it left behind */
+  char *out;
+  size_t outlen;
+  size_t outcap;
+  int exitoc;
+  int newlines;
+  style_t exitstyle;
+  /* statistics of the rendering */
+  uint64_t elements;
+  uint64_t escbytes;
+  uint64_t wraps;
+  /* levels of the entry stack still in place */
+  int keep;
+};
+
+struct tml_template {
+  /* compiled document */
+  char *code;
+  const char *ops;
+  const char *str;
+  /* segments between variables */
+  struct segment *segs;
+  size_t nsegs;
+};
+
+/* check whether we are in the state a segment was rendered from */
+static int segment_match(struct processor *this, struct segment *seg)
+{
+  int i;
+  if(!seg->valid || this->attrover || seg->oc != this->oc
+     || seg->tstyle != this->tstyle || seg->depth != this->attrn) {
+    return 0;
+  }
+  for(i = 0; i < seg->depth; i++) {
+    if(seg->stack[i] != this->attrs[i].style) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static void segment_render(struct processor *this,
+			   struct tml_template *t, struct segment *seg)
+{
+  struct attributes *a;
+  struct tml_stats stats;
+  size_t i, start, lost;
+  int ol, low, n;
+
+  /* replay the previous rendering */
+  if(segment_match(this, seg)) {
+    emit_raw(this, seg->out, seg->outlen);
+    this->attrn = seg->keep;
+    for(n = 0; n < seg->npushed; n++) {
+      a = attr_push(this);
+      a->style = seg->stack[seg->depth + n];
+    }
+    this->oc = seg->exitoc;
+    this->ol += seg->newlines;
+    this->tstyle = seg->exitstyle;
+    this->stats.newlines += seg->newlines;
+    this->stats.elements += seg->elements;
+    this->stats.escbytes += seg->escbytes;
+    this->stats.wraps += seg->wraps;
+    emit_sync(this, FLUSH_EVENT);
+    return;
+  }
+
+  /* render it for real, remembering where we started */
+  seg->valid = 0;
+  seg->oc = this->oc;
+  seg->tstyle = this->tstyle;
+  seg->depth = this->attrn;
+  start = this->olen;
+  stats = this->stats;
+  lost = this->omem ? this->omem->lost : 0;
+  ol = this->ol;
+  low = this->attrn;
+  n = this->attrover;
+  if(this->attrn > seg->stackcap) {
+    seg->stackcap = this->attrn;
+    seg->stack = realloc(seg->stack, seg->stackcap * sizeof(style_t));
+    if(!seg->stack) {
+      abort();
+    }
+  }
+  for(i = 0; i < (size_t)this->attrn; i++) {
+    seg->stack[i] = this->attrs[i].style;
+  }
+
+  for(i = 0; i < seg->nops; i++) {
+    code_step(this, t->ops, t->str, seg->first + i);
+    if(this->attrn < low) {
+      low = this->attrn;
+    }
+    n |= this->attrover;
+  }
+
+  /* only keep renderings that are still in the buffer in full */
+  if(n || this->stats.writes != stats.writes
+     || (this->omem && this->omem->lost != lost)) {
+    return;
+  }
+  if(this->olen - start > seg->outcap) {
+    seg->outcap = this->olen - start;
+    seg->out = realloc(seg->out, seg->outcap);
+    if(!seg->out) {
+      abort();
+    }
+  }
+  memcpy(seg->out, this->obuf + start, this->olen - start);
+  seg->outlen = this->olen - start;
+  seg->keep = low;
+  seg->npushed = this->attrn - low;
+  if(seg->depth + seg->npushed > seg->stackcap) {
+    seg->stackcap = seg->depth + seg->npushed;
+    seg->stack = realloc(seg->stack, seg->stackcap * sizeof(style_t));
+    if(!seg->stack) {
+      abort();
+    }
+  }
+  for(n = 0; n < seg->npushed; n++) {
+    seg->stack[seg->depth + n] = this->attrs[low + n].style;
+  }
+  seg->exitoc = this->oc;
+  seg->newlines = this->ol - ol;
+  seg->exitstyle = this->tstyle;
+  seg->elements = this->stats.elements - stats.elements;
+  seg->escbytes = this->stats.escbytes - stats.escbytes;
+  seg->wraps = this->stats.wraps - stats.wraps;
+  seg->valid = 1;
+}
+
+struct tml_template *processor_template(struct processor *this,
+					const char *buf, size_t len)
+{
+  struct tml_template *t;
+  struct tml_buffer code;
+  struct code_header h;
+  struct code_op op;
+  struct segment *seg = NULL;
+  size_t i, cap = 0;
+
+  t = calloc(1, sizeof(*t));
+  if(!t) {
+    return NULL;
+  }
+
+  /* compile markup, keep a copy of compiled documents */
+  memset(&code, 0, sizeof(code));
+  code.grow = 1;
+  if(processor_compiled(buf, len)) {
+    code.data = malloc(len ? len : 1);
+    if(!code.data) {
+      goto err;
+    }
+    memcpy(code.data, buf, len);
+    code.len = len;
+  } else if(processor_compile(this, buf, len, &code) != TML_OK) {
+    goto err;
+  }
+  t->code = code.data;
+  if(code_check(t->code, code.len, &h)) {
+    goto err;
+  }
+  t->ops = t->code + sizeof(h);
+  t->str = t->ops + h.nops * sizeof(op);
+
+  /* split at variables */
+  for(i = 0; i <= h.nops; i++) {
+    if(i < h.nops) {
+      memcpy(&op, t->ops + i * sizeof(op), sizeof(op));
+    }
+    if(t->nsegs == 0 || seg->var) {
+      t->segs = comp_grow(t->segs, &cap, t->nsegs + 1, sizeof(*t->segs));
+      seg = &t->segs[t->nsegs++];
+      memset(seg, 0, sizeof(*seg));
+      seg->first = i;
+    }
+    if(i == h.nops) {
+      break;
+    }
+    if(op.op == OP_VAR) {
+      seg->var = t->str + op.a;
+      seg->varlen = op.b;
+    } else {
+      seg->nops++;
+    }
+  }
+
+  return t;
+
+ err:
+  free(code.data);
+  free(t);
+  return NULL;
+}
+
+int processor_render_template(struct processor *this,
+			      struct tml_template *t,
+			      struct tml_buffer *out)
+{
+  struct output_save save = { 0 };
+  struct segment *seg;
+  size_t i;
+  int phase;
+
+  if(out) {
+    omem_enter(this, out, &save);
+  }
+
+  phase = stats_phase(this, PHASE_EMIT);
+  document_begin(this);
+  for(i = 0; i < t->nsegs; i++) {
+    seg = &t->segs[i];
+    segment_render(this, t, seg);
+    if(seg->var) {
+      render_var(this, seg->var, seg->varlen);
+      emit_sync(this, FLUSH_EVENT);
+    }
+  }
+  document_end(this);
+  stats_phase(this, phase);
+
+  if(out) {
+    omem_leave(this, &save);
+    return out->lost ? TML_TRUNCATED : TML_OK;
+  }
+  return TML_OK;
+}
+
+void processor_template_free(struct tml_template *t)
+{
+  size_t i;
+  if(!t) {
+    return;
+  }
+  for(i = 0; i < t->nsegs; i++) {
+    free(t->segs[i].stack);
+    free(t->segs[i].out);
+  }
+  free(t->segs);
+  free(t->code);
+  free(t);
+}
+
+int processor_setvar(struct processor *this, const char *name,
+		     const char *value, size_t len)
+{
+  struct tml_var *v;
+  size_t n = strlen(name);
+  char *d;
+
+  v = (struct tml_var *)var_lookup(this, name, n);
+  if(!v) {
+    if(this->nvars == this->varcap) {
+      n = this->varcap ? 2 * this->varcap : 8;
+      v = realloc(this->vars, n * sizeof(*v));
+      if(!v) {
+	return 1;
+      }
+      this->vars = v;
+      this->varcap = n;
+    }
+    v = &this->vars[this->nvars];
+    memset(v, 0, sizeof(*v));
+    v->name = strdup(name);
+    if(!v->name) {
+      return 1;
+    }
+    v->namelen = strlen(name);
+    this->nvars++;
+  }
+
+  if(len > v->cap) {
+    d = realloc(v->value, len);
+    if(!d) {
+      return 1;
+    }
+    v->value = d;
+    v->cap = len;
+  }
+  /* empty values may not have storage yet */
+  if(len) {
+    memcpy(v->value, value, len);
+  }
+  v->len = len;
+  return 0;
+}
+
+void processor_clearvars(struct processor *this)
+{
+  int i;
+  /* keep names and storage for the next round */
+  for(i = 0; i < this->nvars; i++) {
+    this->vars[i].len = 0;
+  }
+}
@@ -0,0 +1,403 @@
+/*
+ * TML - Terminal markup language
+ *
+ * Renders a small subset of Pango style markup to terminal control
+ * sequences using expat and terminfo.
+ */
+
+#ifndef TML_H
+#define TML_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <termios.h>
+
+#include <expat.h>
+
+/* results of the render functions */
+#define TML_OK        0
+#define TML_ERROR     1
+#define TML_TRUNCATED 2
+
+/* a complete text style packed into one word */
+typedef uint32_t style_t;
+
+struct attributes {
+  int id;
+  style_t style;
+};
+
+/* longest transition kept in the cache */
+#define TCACHE_SEQ 64
+/* number of cached transitions, must be a power of two */
+#define TCACHE_SIZE 256
+
+/* a memoized style transition */
+struct transition {
+  uint64_t key;
+  unsigned char used;
+  unsigned char len;
+  char seq[TCACHE_SEQ];
+};
+
+/* flush policies, in order of increasing laziness */
+enum flush_policy {
+  /* flush after every parser event */
+  FLUSH_EVENT,
+  /* flush after every line */
+  FLUSH_LINE,
+  /* flush when the buffer reaches a size threshold */
+  FLUSH_SIZE,
+  /* flush when input has been idle for a while */
+  FLUSH_IDLE,
+  /* flush once per document */
+  FLUSH_DOCUMENT,
+};
+
+/* memory output for processor_render */
+struct tml_buffer {
+  char *data;
+  size_t len;
+  size_t cap;
+  /* buffer may be grown with realloc */
+  int grow;
+  /* most it is grown to, 0 for no limit */
+  size_t max;
+  /* bytes that did not fit */
+  size_t lost;
+};
+
+/* phases that are timed for statistics */
+enum tml_phase {
+  /* outside of the processor */
+  PHASE_IDLE,
+  /* parsing markup */
+  PHASE_PARSE,
+  /* rendering parsed markup */
+  PHASE_EMIT,
+  /* writing output */
+  PHASE_FLUSH,
+  PHASE_COUNT,
+};
+
+/* cheap counters, always maintained */
+struct tml_stats {
+  /* documents started */
+  uint64_t documents;
+  /* markup fed or executed */
+  uint64_t ibytes;
+  /* bytes written to the output file */
+  uint64_t obytes;
+  /* control sequence bytes produced */
+  uint64_t escbytes;
+  /* write calls */
+  uint64_t writes;
+  /* tiparm calls */
+  uint64_t tiparms;
+  /* elements started */
+  uint64_t elements;
+  /* deepest nesting seen */
+  uint64_t depth;
+  /* lines ended, and those ended by wrapping */
+  uint64_t newlines;
+  uint64_t wraps;
+  /* nanoseconds spent in each phase, if timed */
+  uint64_t ns[PHASE_COUNT];
+};
+
+/* events recorded in a trace */
+enum tml_trace_event {
+  TRACE_START,
+  TRACE_END,
+  TRACE_CDATA,
+  TRACE_SWITCH,
+  TRACE_EMIT,
+};
+
+/* a trace record, 16 bytes */
+struct tml_trace_rec {
+  /* timestamp counter */
+  uint64_t time;
+  /* input offset, style switched to, or output offset */
+  uint32_t off;
+  /* bytes concerned, saturated */
+  uint16_t len;
+  uint8_t type;
+  /* element, 255 if unknown */
+  uint8_t id;
+};
+
+/* ring of the most recent trace records */
+struct tml_trace {
+  struct tml_trace_rec *recs;
+  uint64_t mask;
+  /* records written so far */
+  uint64_t head;
+  /* clock readings at creation, for scaling timestamps */
+  uint64_t tsc0;
+  uint64_t ns0;
+};
+
+#define TRACE_MAGIC "TMLT"
+#define TRACE_VERSION 1
+
+/* header of a dumped ring, followed by the element names and records */
+struct tml_trace_header {
+  char magic[4];
+  uint32_t version;
+  /* number of the ring in the dump */
+  uint32_t ring;
+  /* bytes of NUL terminated element names, by id */
+  uint32_t namelen;
+  /* records that follow, oldest first, and records overwritten */
+  uint64_t nrecs;
+  uint64_t lost;
+  /* clock readings at creation and at the dump */
+  uint64_t tsc0;
+  uint64_t ns0;
+  uint64_t tsc1;
+  uint64_t ns1;
+};
+
+/* a template variable */
+struct tml_var {
+  char *name;
+  size_t namelen;
+  char *value;
+  size_t len;
+  size_t cap;
+};
+
+/* a document prepared for repeated rendering */
+struct tml_template;
+
+/* output backend used instead of write(2) on ofd */
+struct tml_writer {
+  /* take up to LEN bytes of BUF, all of them if BLOCK, returns how
+     many were taken */
+  size_t (*write)(struct tml_writer *w, const char *buf, size_t len,
+		  int block);
+};
+
+/* expanded terminal capabilities */
+struct termcaps;
+/* an attribute of an element, pointing into the input */
+struct tml_att;
+
+/* state of the built-in tokenizer for the current document */
+struct tml_scanner {
+  /* expat has taken over */
+  int expat;
+  /* the last token needs more input */
+  int more;
+  /* open elements by id */
+  unsigned char *stack;
+  int depth;
+  int stackcap;
+  /* the root element has been closed */
+  int done;
+  /* input offset of the next token */
+  uint64_t pos;
+  /* incomplete token kept from the last chunk */
+  char *carry;
+  size_t carrylen;
+  size_t carrycap;
+};
+
+/* state of processor_compile */
+struct compiler;
+
+/* emitter thread and ring of processor_pipeline_start */
+struct tml_pipeline;
+
+struct processor {
+  /* enable body mode */
+  int body;
+  /* enable debug output */
+  int debug;
+  /* produce raw terminal output */
+  int rawtty;
+  /* do not use buffering */
+  int unbuffered;
+  /* output flush policy */
+  int flush;
+  /* flush threshold for FLUSH_SIZE */
+  size_t flushsize;
+  /* idle timeout for FLUSH_IDLE */
+  int flushidle;
+
+  /* terminal type */
+  char *term;
+  /* terminal width */
+  int termw;
+  /* terminal capabilities */
+  struct termcaps *caps;
+  /* capabilities belong to another processor */
+  int capsshared;
+
+  /* old terminal settings */
+  struct termios old_termios;
+  /* our terminal settings */
+  struct termios our_termios;
+
+  /* command-provided xml */
+  char *expression;
+
+  /* input file */
+  char *ifile;
+  int ifd;
+  /* mapped input file */
+  const char *imap;
+  size_t imaplen;
+
+  /* output file */
+  char *ofile;
+  int ofd;
+  /* writes to ofd while set */
+  struct tml_writer *writer;
+
+  /* output buffer */
+  char *obuf;
+  size_t olen;
+  size_t ocap;
+  /* flushes only write what ofd accepts without blocking */
+  int oasync;
+  /* flushed bytes at the start of the buffer not written yet */
+  size_t oqueued;
+  /* memory output, replaces ofd while set */
+  struct tml_buffer *omem;
+
+  /* output state */
+  int ol;
+  int oc;
+  int ow;
+  /* fill backgrounds with clr_eol */
+  int eolfill;
+
+  /* attribute state */
+  int attrid;
+  /* style in effect on the terminal */
+  style_t tstyle;
+  /* attribute stack */
+  struct attributes *attrs;
+  int attrn;
+  int attrcap;
+  /* maximum nesting depth */
+  int attrmax;
+  /* levels dropped beyond the maximum */
+  int attrover;
+  /* target for styles that are dropped */
+  struct attributes attrnull;
+
+  /* transition cache */
+  struct transition tcache[TCACHE_SIZE];
+
+  /* tokenizer, and expat for everything it does not handle */
+  struct tml_scanner scan;
+  XML_Parser xml;
+  /* parser needs a reset before the next document */
+  int xmlused;
+  /* parser is catching up, its events are ignored */
+  int replay;
+  /* attributes of the current element */
+  struct tml_att *atts;
+  int attcap;
+  /* compiler recording instead of rendering */
+  struct compiler *comp;
+  /* rendering on another thread while set */
+  struct tml_pipeline *pipeline;
+
+  /* template variables */
+  struct tml_var *vars;
+  int nvars;
+  int varcap;
+
+  /* trace ring, if tracing, not owned */
+  struct tml_trace *trace;
+
+  /* statistics */
+  struct tml_stats stats;
+  /* time phases, which costs a clock read per event */
+  int timed;
+  /* phase being timed and when it started */
+  int phase;
+  uint64_t phasestart;
+};
+
+/* set defaults, to be adjusted before processor_setup */
+int processor_init(struct processor *this);
+/* prepare output, parser and terminal */
+int processor_setup(struct processor *this);
+/* prepare output and parser, borrowing the terminal of SHARED, which
+   must stay set up while this processor is in use */
+int processor_setup_shared(struct processor *this,
+			   const struct processor *shared);
+/* release everything acquired by processor_setup */
+int processor_fini(struct processor *this);
+
+/* start a document, reusing the parser */
+int processor_begin(struct processor *this);
+/* feed a chunk of the current document */
+int processor_feed(struct processor *this, const char *buf, size_t len);
+/* finish the current document */
+int processor_end(struct processor *this);
+/* write out buffered output */
+void processor_flush(struct processor *this);
+/* write queued output of an asynchronous processor, waiting for
+   all of it if BLOCK, returns 1 while some is still queued */
+int processor_drain(struct processor *this, int block);
+/* flush if the policy is at least as eager as LEVEL */
+void processor_sync(struct processor *this, enum flush_policy level);
+/* append bytes to the output verbatim */
+void processor_write(struct processor *this, const char *buf, size_t len);
+
+/* render on a second thread from here on, this thread only parses.
+   until processor_pipeline_stop, only begin, feed, end, flush, sync
+   and write may be used, and output happens on the other thread */
+int processor_pipeline_start(struct processor *this);
+/* render everything queued and stop the thread, also done by
+   processor_fini */
+int processor_pipeline_stop(struct processor *this);
+
+/* add the statistics of FROM to TO */
+void processor_stats_add(struct tml_stats *to, const struct tml_stats *from);
+
+/* allocate a trace ring of at least RECORDS records */
+struct tml_trace *processor_trace_new(size_t records);
+/* write the ring to FD as ring number RING, safe in signal handlers */
+int processor_trace_dump(const struct tml_trace *t, int fd, int ring);
+void processor_trace_free(struct tml_trace *t);
+
+/* render a complete document into memory, appending to OUT,
+   compiled documents are accepted as well */
+int processor_render(struct processor *this,
+		     const char *buf, size_t len,
+		     struct tml_buffer *out);
+
+/* compile a complete document into memory, appending to OUT */
+int processor_compile(struct processor *this,
+		      const char *buf, size_t len,
+		      struct tml_buffer *out);
+/* check whether BUF holds a compiled document */
+int processor_compiled(const char *buf, size_t len);
+/* render a compiled document without parsing */
+int processor_exec(struct processor *this, const char *buf, size_t len);
+
+/* set template variable NAME to LEN bytes of VALUE */
+int processor_setvar(struct processor *this, const char *name,
+		     const char *value, size_t len);
+/* empty the values of all template variables */
+void processor_clearvars(struct processor *this);
+
+/* prepare a document, markup or compiled, for repeated rendering
+   by this processor */
+struct tml_template *processor_template(struct processor *this,
+					const char *buf, size_t len);
+/* render a prepared document with the current variables,
+   into OUT if given and to the regular output otherwise */
+int processor_render_template(struct processor *this,
+			      struct tml_template *t,
+			      struct tml_buffer *out);
+void processor_template_free(struct tml_template *t);
+
+#endif /* TML_H */
@@ -1,842 +1,160 @@
 
-#undef USE_GETOPT_LONG
-#undef USE_WCHAR
+#define USE_GETOPT_LONG
 
-#include <ctype.h>
 #include <errno.h>
 #include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
-#include <termios.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-#ifdef USE_WCHAR
-#include <wcstype.h>
-#endif
+#include "tml2tty.h"
 
-#include <curses.h>
-#include <term.h>
+/* slice of a mapped input file handed to the parser at once */
+#define INPUT_SLICE (1 << 20)
+/* bytes read from a stream at once */
+#define INPUT_READ 4096
 
-#include <expat.h>
+/* long-only options */
+#define OPT_SERVE 0x100
+#define OPT_BATCH 0x101
+#define OPT_COMPILE 0x102
+#define OPT_TEMPLATE 0x103
+#define OPT_STATS 0x104
+#define OPT_TRACE 0x105
+#define OPT_URING 0x106
+#define OPT_PIPELINE 0x107
 
-#define TOP 0
-#define BOTTOM 1
-#define LEFT 2
-#define RIGHT 3
+/* longest variable name */
+#define VAR_NAME 64
 
+/* deepest nesting limit that can be requested */
+#define DEPTH_MAX (1 << 20)
 
-static int boolean_decode(const char *c) {
-  return strcmp(c, "true") == 0 ? 1 : 0;
-}
+/* records kept per trace ring */
+#define TRACE_RECORDS 65536
 
-#ifndef COLOR_DEFAULT
-#define COLOR_DEFAULT -1
-#endif
+/* trace rings of all processors, dumped together */
+static struct tml_trace *traces[1 + BATCH_WORKERS];
+static volatile sig_atomic_t ntraces;
+static const char *tracefile;
 
-struct color {
-  char *name;
-  int value;
-};
-
-struct color colors[] = {
-  {"default", COLOR_DEFAULT},
-  {"black", COLOR_BLACK},
-  {"red", COLOR_RED},
-  {"green", COLOR_GREEN},
-  {"yellow", COLOR_YELLOW},
-  {"blue", COLOR_BLUE},
-  {"magenta", COLOR_MAGENTA},
-  {"cyan", COLOR_CYAN},
-  {"white", COLOR_WHITE},
-  {NULL},
-};
-
-static int color_decode(const char *c) {
-  int i, res = COLOR_DEFAULT;
-  long l;
-  char *e;
-  for(i = 0; colors[i].name; i++) {
-    if(strcmp(colors[i].name, c) == 0) {
-      res = colors[i].value;
-    }
-  }
-  l = strtol(c, &e, 10);
-  if(e != c && !*e) {
-    res = (int)l;
-  }
-
-  return res;
-}
-
-struct attributes {
-  struct attributes *next;
-  int id;
-  int bg;
-  int fg;
-  int b;
-  int i;
-  int u;
-  int sub;
-  int sup;
-  int blink;
-  int reverse;
-  int standout;
-};
-
-static void attr_zero(struct attributes *attr) {
-  struct attributes *save;
-  save = attr->next;
-  bzero(attr, sizeof(*attr));
-  attr->next = save;
-  attr->bg = COLOR_DEFAULT;
-  attr->fg = COLOR_DEFAULT;
-}
-
-struct processor {
-  /* enable body mode */
-  int body;
-  /* enable debug output */
-  int debug;
-  /* produce raw terminal output */
-  int rawtty;
-  /* do not use buffering */
-  int unbuffered;
-
-  /* terminal type */
-  char *term;
-  /* terminal width */
-  int termw;
-
-  /* old terminal settings */
-  struct termios old_termios;
-  /* our terminal settings */
-  struct termios our_termios;
-
-  /* command-provided xml */
-  char *expression;
-
-  /* input file */
-  char *ifile;
-  FILE *is;
-  int ifd;
-
-  /* output file */
-  char *ofile;
-  FILE *os;
-  int ofd;
-
-  /* output state */
-  int ol;
-  int oc;
-  int ow;
-
-  /* attribute state */
-  int attrid;
-  struct attributes *attr;
-
-  /* xml parser */
-  XML_Parser xml;
-};
-
-static struct attributes *attr_push(struct processor *this);
-static void attr_apply(struct processor *this);
-static void attr_pop(struct processor *this);
-
-static void emit_raw(struct processor *this, const char *buf, size_t len)
-{
-  if(this->os && !this->unbuffered) {
-    size_t res = fwrite(buf, 1, len, this->os);
-    if(res < len) {
-      perror("fwrite");
-      exit(1);
-    }
-  } else {
-    ssize_t res;
-    size_t done = 0;
-    while(done < len) {
-      res = write(this->ofd, buf + done, len - done);
-      if(res < 0) {
-	perror("write");
-	exit(1);
-      }
-      if(res >= 0) {
-	done += res;
-      }
-    }
-  }
-}
-
-static void emit_ntimes(struct processor *this, char c, size_t count)
-{
-  char buf[32];
-  memset(buf, c, sizeof(buf));
-  while(count) {
-    size_t w = count;
-    if(w > sizeof(buf))
-      w = sizeof(buf);
-    emit_raw(this, buf, w);
-    count -= w;
-  }
-}
-
-static void emit_flush(struct processor *this)
-{
-  if(this->os && !this->unbuffered) {
-    fflush(this->os);
-  }
-}
+/* input and output go through io_uring */
+static int uring;
 
-static void emit_control(struct processor *this, const char *str)
-{
-  if(str) {
-    emit_raw(this, str, strlen(str));
-  }
-}
-
-#define emit_tparm(this, parm, ...)		  \
-  { if (parm) {					  \
-      char *str = tiparm(parm, ##__VA_ARGS__);	  \
-      if(str) { emit_control(this, str); }	  \
-    } }
-
-static void emit_newline(struct processor *this)
-{
-  struct attributes *attr = this->attr;
-  if(this->debug)
-    fprintf(stderr, "emit_newline ol=%d oc=%d\n", this->ol, this->oc);
-  if(this->attr && this->attr->bg != COLOR_DEFAULT) {
-    int spaces;
-    struct attributes *attr;
-    if(this->oc < this->ow) {
-      spaces = this->ow - this->oc;
-      emit_ntimes(this, ' ', spaces);
-    }
-#if 0
-    if(this->ow < this->termw && this->rawtty && back_color_erase) {
-      spaces == this->termw - this->ow;
-      attr = attr_push(this);
-      attr_zero(attr);
-      attr_apply(this);
-      emit_ntimes(this, ' ', spaces);
-      attr_pop(this);
-    }
-#endif
-  }
-  emit_control(this, this->rawtty ? "\r\n" : "\n");
-  emit_flush(this);
-  this->ol++; this->oc = 0;
+static void usage(const char *argv0) {
+  fprintf(stderr, "Usage: %s [<higher magic>]\n", argv0);
 }
 
-static void emit_chars(struct processor *this, const char *str, size_t len)
+static int flush_decode(struct processor *this, const char *c)
 {
-  if(this->debug)
-    fprintf(stderr, "emit_chars len=%d\n", (int)len);
-  if(str) {
-    int i;
-    int l = len, s;
-    const char *p = str;
-    while(l > 0 && *p) {
-      i = 0;
-      s = this->ow - this->oc;
-      if(s < 0) {
-	s = 0;
-      }
-
-      while(i < l && p[i] && isgraph(p[i])) {
-	i++;
-      }
-      if(i) {
-	if(i > s) {
-	  i = s;
-	}
-	emit_raw(this, p, i);
-	this->oc += i;
-	if(i == s) {
-	  emit_newline(this);
-	}
-	goto next;
-      }
-
-      while(i < l && p[i] && p[i] == ' ') {
-	i++;
-      }
-      if(i) {
-	int e = i;
-	if(e > s) {
-	  e = s;
-	}
-	if(this->oc > 0) {
-	  emit_raw(this, p, e);
-	  this->oc += i;
-	}
-	goto next;
-      }
+  const char *v = strchr(c, '=');
+  size_t n = v ? (size_t)(v - c) : strlen(c);
+  long l = 0;
+  char *e;
 
-    next:
-      /* set up for next token */
-      p += i;
-      l -= i;
-    }
+  /* names may be abbreviated, but not left out */
+  if(n == 0) {
+    return 1;
   }
-}
-
-static void emit_text(struct processor *this, const char *str, size_t len)
-{
-  if(str) {
-    int i;
-    int l = len;
-    const char *p = str;
-    while(l > 0 && *p) {
-      i = 0;
-
-      /* printable characters */
-      while(i < l && p[i] && (isgraph(p[i]) || p[i] == ' ' || p[i] == '\t')) {
-	i++;
-      }
-      if(i) {
-	emit_chars(this, p, i);
-	goto next;
-      }
-
-      /* ignored whitespace */
-      while(i < l && p[i] && (p[i] == '\r'|| p[i] == '\v')) {
-	i++;
-      }
-      if(i) {
-	goto next;
-      }
-
-      /* newline */
-      if(i < l && p[i] && p[i] == '\n') {
-	i++;
-	emit_newline(this);
-	goto next;
-      }
-
-      /* any other control chars */
-      while(i < l && p[i]) {
-	i++;
-      }
-      if(i) {
-	goto next;
-      }
-
-      /* should never get here */
-      fprintf(stderr, "Tokenizer error!?\n");
-      exit(1);
-
-    next:
-      /* set up for next token */
-      p += i;
-      l -= i;
+  if(v) {
+    l = strtol(v + 1, &e, 10);
+    if(e == v + 1 || *e || l < 0 || l > INT_MAX) {
+      return 1;
     }
   }
-}
 
-static void attr_switch(struct processor *this,
-			struct attributes *old, struct attributes *new)
-{
-  int all = 0, set = 0, flg = 0;
-
-  /* figure out how to reconfigure */
-  if(old && new) {
-    /* these have no exit call */
-    if(old->b && !new->b) {
-      set = 1;
-    }
-    if(old->u && !new->u) {
-      set = 1;
-    }
-    if(old->blink && !new->blink) {
-      set = 1;
-    }
-    if(old->reverse && !new->reverse) {
-      set = 1;
-    }
-    /* if we can't set then clear all */
-    if(set && !set_attributes) {
-      all = 1;
-    }
-  }
-  if(new) {
-    /* default colors are reached by reset */
-    if(new->bg == COLOR_DEFAULT && (!old || old->bg != COLOR_DEFAULT)) {
-      all = 1;
-    }
-    if(new->fg == COLOR_DEFAULT && (!old || old->fg != COLOR_DEFAULT)) {
-      all = 1;
-    }
-    /* count enabled flags */
-    if(new->b) {
-      flg++;
-    }
-    if(new->u) {
-      flg++;
+  if(strncmp(c, "event", n) == 0 && !v) {
+    this->flush = FLUSH_EVENT;
+  } else if(strncmp(c, "line", n) == 0 && !v) {
+    this->flush = FLUSH_LINE;
+  } else if(strncmp(c, "size", n) == 0) {
+    this->flush = FLUSH_SIZE;
+    if(v && l == 0) {
+      return 1;
     }
-    if(new->blink) {
-      flg++;
+    if(v) {
+      this->flushsize = (size_t)l;
     }
-    if(new->reverse) {
-      flg++;
+  } else if(strncmp(c, "idle", n) == 0) {
+    this->flush = FLUSH_IDLE;
+    if(v) {
+      this->flushidle = (int)l;
     }
-  }
-  if(!old && !new) {
-    all = 1;
-    flg = 0;
-  }
-
-  /* reset attributes */
-  if(all) {
-    emit_tparm(this, exit_attribute_mode);
-  }
-
-  /* done if we have no new attrs */
-  if(!new) {
-    return;
-  }
-
-  /* optimizable attributes */
-  if(set_attributes && (set || flg > 1)) {
-    /* optimized call */
-    emit_tparm(this, set_attributes,
-	       new->standout, new->u, new->reverse,
-	       new->blink, 0, new->b,
-	       0, 0, 0);
+  } else if(strncmp(c, "document", n) == 0 && !v) {
+    this->flush = FLUSH_DOCUMENT;
   } else {
-    /* set bold */
-    if(new->b) {
-      emit_tparm(this, enter_bold_mode);
-    }
-    /* set underline */
-    if(new->u) {
-      emit_tparm(this, enter_underline_mode);
-    }
-    /* set blink */
-    if(new->blink) {
-      emit_tparm(this, enter_blink_mode);
-    }
-    /* set reverse */
-    if(new->reverse) {
-      emit_tparm(this, enter_reverse_mode);
-    }
-    /* set standout */
-    if(new->reverse) {
-      emit_tparm(this, enter_standout_mode);
-    }
-  }
-
-  /* set italic */
-  if(new->i && (!old || !old->i)) {
-    emit_tparm(this, enter_italics_mode);
-  } else if((!old || old->i) && !all) {
-    emit_tparm(this, exit_italics_mode);
-  }
-  /* set superscript */
-  if(new->standout && (!old || !old->standout)) {
-    emit_tparm(this, enter_standout_mode);
-  } else if((!old || old->standout) && !all) {
-    emit_tparm(this, exit_standout_mode);
-  }
-  /* set subscript */
-  if(new->sub && (!old || !old->sub)) {
-    emit_tparm(this, enter_subscript_mode);
-  } else if((!old || old->sub) && !all) {
-    emit_tparm(this, exit_subscript_mode);
-  }
-  /* set superscript */
-  if(new->sup && (!old || !old->sup)) {
-    emit_tparm(this, enter_superscript_mode);
-  } else if((!old || old->sup) && !all) {
-    emit_tparm(this, exit_superscript_mode);
-  }
-  /* set bg color */
-  if(new->bg != COLOR_DEFAULT) {
-    emit_tparm(this, set_a_background, new->bg);
-  }
-  /* set fg color */
-  if(new->fg != COLOR_DEFAULT) {
-    emit_tparm(this, set_a_foreground, new->fg);
-  }
-}
-
-static struct attributes *attr_push(struct processor *this)
-{
-  struct attributes *new = calloc(1, sizeof(struct attributes));
-  struct attributes *old = this->attr;
-  if(!new) {
-    abort();
-  }
-  if(old) {
-    memcpy(new, this->attr, sizeof(*new));
-    new->next = old;
-  }
-  new->id = this->attrid++;
-  this->attr = new;
-  return new;
-}
-
-static void attr_apply(struct processor *this)
-{
-  struct attributes *new = this->attr;
-  struct attributes *old = NULL;
-  if(new) {
-    old = new->next;
-  }
-  if(old) {
-    attr_switch(this, old, new);
-  }
-}
-
-static void attr_pop(struct processor *this)
-{
-  struct attributes *old = this->attr;
-  struct attributes *new = NULL;
-  if(old) {
-    new = old->next;
-  }
-  attr_switch(this, old, new);
-  if(old) {
-    free(old);
-  }
-  this->attr = new;
-}
-
-static void element_span_start(struct processor *this,
-			       const XML_Char *name,
-			       const XML_Char **atts)
-{
-  int i;
-  struct attributes *a = attr_push(this);
-  for(i = 0; atts[i]; i += 2) {
-    const XML_Char *att = atts[i];
-    const XML_Char *val = atts[i+1];
-    if(strcmp(att, "background") == 0) {
-      a->bg = color_decode(val);
-    } else if(strcmp(att, "foreground") == 0) {
-      a->fg = color_decode(val);
-    } else if(strcmp(att, "bg") == 0) {
-      a->bg = color_decode(val);
-    } else if(strcmp(att, "fg") == 0) {
-      a->fg = color_decode(val);
-    } else if(strcmp(att, "b") == 0) {
-      a->b = boolean_decode(val);
-    } else if(strcmp(att, "i") == 0) {
-      a->i = boolean_decode(val);
-    } else if(strcmp(att, "u") == 0) {
-      a->u = boolean_decode(val);
-    } else if(strcmp(att, "sub") == 0) {
-      a->sub = boolean_decode(val);
-    } else if(strcmp(att, "sup") == 0) {
-      a->sup = boolean_decode(val);
-    } else if(strcmp(att, "blink") == 0) {
-      a->blink = boolean_decode(val);
-    } else if(strcmp(att, "reverse") == 0) {
-      a->reverse = boolean_decode(val);
-    } else if(strcmp(att, "standout") == 0) {
-      a->standout = boolean_decode(val);
-    }
-  }
-  attr_apply(this);
-}
-
-static void element_b_start(struct processor *this,
-			    const XML_Char *name,
-			    const XML_Char **atts)
-{
-  attr_push(this)->b = 1;
-  attr_apply(this);
-}
-
-static void element_i_start(struct processor *this,
-			    const XML_Char *name,
-			    const XML_Char **atts)
-{
-  attr_push(this)->i = 1;
-  attr_apply(this);
-}
-
-static void element_u_start(struct processor *this,
-			    const XML_Char *name,
-			    const XML_Char **atts)
-{
-  attr_push(this)->u = 1;
-  attr_apply(this);
-}
-
-static void element_sub_start(struct processor *this,
-			      const XML_Char *name,
-			      const XML_Char **atts)
-{
-  attr_push(this)->sub = 1;
-  this->attr->sub = 1;
-  attr_apply(this);
-}
-
-static void element_sup_start(struct processor *this,
-			      const XML_Char *name,
-			      const XML_Char **atts)
-{
-  attr_push(this)->sup = 1;
-  attr_apply(this);
-}
-
-static void element_blink_start(struct processor *this,
-				const XML_Char *name,
-				const XML_Char **atts)
-{
-  attr_push(this)->blink = 1;
-  attr_apply(this);
-}
-
-static void element_reverse_start(struct processor *this,
-				  const XML_Char *name,
-				  const XML_Char **atts)
-{
-  attr_push(this)->reverse = 1;
-  attr_apply(this);
-}
-
-static void element_standout_start(struct processor *this,
-				   const XML_Char *name,
-				   const XML_Char **atts)
-{
-  attr_push(this)->standout = 1;
-  attr_apply(this);
-}
-
-static void element_fgcolor_start(struct processor *this,
-				  const XML_Char *name,
-				  const XML_Char **atts)
-{
-  attr_push(this)->fg = color_decode(name);
-  attr_apply(this);
-}
-
-static void element_attr_end(struct processor *this)
-{
-  attr_pop(this);
-}
-
-
-static void element_br_start(struct processor *this,
-			     const XML_Char *name,
-			     const XML_Char **atts)
-{
-  emit_newline(this);
-}
-
-static void element_p_start(struct processor *this,
-			    const XML_Char *name,
-			    const XML_Char **atts)
-{
-  if(this->oc > 0) {
-    emit_newline(this);
-  }
-}
-
-static void element_p_end(struct processor *this)
-{
-#if 0
-  if(this->oc > 0) {
-    emit_newline(this);
-  }
-#endif
-}
-
-static void element_tml_start(struct processor *this,
-			      const XML_Char *name,
-			      const XML_Char **atts)
-{
-}
-
-static void element_tml_end(struct processor *this)
-{
-}
-
-struct element {
-  char *name;
-  void (*element_start)(struct processor *this,
-			const XML_Char *name,
-			const XML_Char **atts);
-  void (*element_end)(struct processor *this);
-};
-
-struct element elements[] = {
-  /* attributes */
-  {"span", element_span_start, element_attr_end},
-  {"b", element_b_start, element_attr_end},
-  {"i", element_i_start, element_attr_end},
-  {"u", element_u_start, element_attr_end},
-  {"sub", element_sub_start, element_attr_end},
-  {"sup", element_sup_start, element_attr_end},
-  {"blink", element_blink_start, element_attr_end},
-  {"reverse", element_reverse_start, element_attr_end},
-  {"standout", element_standout_start, element_attr_end},
-  /* colors */
-  {"black", element_fgcolor_start, element_attr_end},
-  {"red", element_fgcolor_start, element_attr_end},
-  {"green", element_fgcolor_start, element_attr_end},
-  {"yellow", element_fgcolor_start, element_attr_end},
-  {"blue", element_fgcolor_start, element_attr_end},
-  {"magenta", element_fgcolor_start, element_attr_end},
-  {"cyan", element_fgcolor_start, element_attr_end},
-  {"white", element_fgcolor_start, element_attr_end},
-  /* formatting */
-  {"br", element_br_start, NULL},
-  {"p", element_p_start, element_p_end},
-  /* compatibility */
-  {"s", NULL, NULL},
-  {"tt", NULL, NULL},
-  {"big", NULL, NULL},
-  {"small", NULL, NULL},
-  /* structural */
-  {"tml", element_tml_start, element_tml_end},
-  /* end */
-  {NULL},
-};
-
-static void handle_start (struct processor *this,
-			  const XML_Char *name,
-			  const XML_Char **atts)
-{
-  int i;
-  if(this->debug)
-    fprintf(stderr, "%s:start\n", name);
-  for(i = 0; elements[i].name; i++) {
-    if(strcmp(name, elements[i].name) == 0) {
-      if(elements[i].element_start) {
-	elements[i].element_start(this, name, atts);
-      }
-      emit_flush(this);
-      return;
-    }
-  }
-}
-
-static void handle_end (struct processor *this,
-			const XML_Char *name)
-{
-  int i;
-  if(this->debug)
-    fprintf(stderr, "%s:end\n", name);
-  for(i = 0; elements[i].name; i++) {
-    if(strcmp(name, elements[i].name) == 0) {
-      if(elements[i].element_end) {
-	elements[i].element_end(this);
-      }
-      emit_flush(this);
-      return;
-    }
-  }
-}
-
-static void handle_cdata (struct processor *this,
-			  const XML_Char *s, int len)
-{
-  if(this->debug)
-    fprintf(stderr, "cdata:%d\n", len);
-  emit_text(this, s, len);
-  emit_flush(this);
-}
-
-static int init_term(struct processor *this)
-{
-  int res, err, fd = this->ofd;
-
-  if(isatty(fd) != 1) {
-    fd = -1;
-  }
-
-  res = setupterm(this->term, fd, &err);
-  if(res != OK) {
-    fprintf(stderr, "Error initializing terminal\n");
     return 1;
   }
 
-  this->termw = columns;
-
-  if(this->rawtty && fd > 0) {
-    cfmakeraw(&this->our_termios);
-
-    res = tcgetattr(fd, &this->old_termios);
-    if(res == -1) {
-      perror("tcgetattr");
-      return 1;
-    }
-
-    res = tcsetattr(fd, 0, &this->our_termios);
-    if(res == -1) {
-      perror("tcsetattr");
-      return 1;
-    }
-  }
-
   return 0;
 }
 
-static int fini_term(struct processor *this)
+void init_renderer(struct processor *this, const struct processor *from)
 {
-  int res, fd = this->ofd;
-
-  if(isatty(fd) != 1) {
-    fd = -1;
-  }
-
-  if(this->rawtty && fd > 0) {
-    res = tcsetattr(1, 0, &this->old_termios);
-    if(res == -1) {
-      perror("tcsetattr");
-      return 1;
-    }
-  }
-
-  return 0;
+  processor_init(this);
+  this->body = from->body;
+  this->debug = from->debug;
+  this->rawtty = from->rawtty;
+  this->timed = from->timed;
+  this->attrmax = from->attrmax;
+  this->ofd = -1;
+  this->ow = from->ow;
 }
 
-static int init_xml(struct processor *this)
+int define_var(struct processor *this, const char *def, size_t len)
 {
-  this->xml = XML_ParserCreate(NULL);
-  if(!this->xml) {
-    fprintf(stderr, "Error initializing expat\n");
+  const char *eq = memchr(def, '=', len);
+  char name[VAR_NAME];
+
+  if(!eq || eq == def || eq - def >= VAR_NAME) {
+    fprintf(stderr, "Invalid variable definition: %.*s\n", (int)len, def);
     return 1;
   }
-  XML_SetUserData(this->xml, this);
-  XML_SetElementHandler(this->xml,
-			(XML_StartElementHandler)&handle_start,
-			(XML_EndElementHandler)&handle_end);
-  XML_SetCharacterDataHandler(this->xml,
-			      (XML_CharacterDataHandler)&handle_cdata);
+  memcpy(name, def, eq - def);
+  name[eq - def] = 0;
 
-  return 0;
+  return processor_setvar(this, name, eq + 1, def + len - eq - 1);
 }
 
-static int fini_xml(struct processor *this)
-{
-  return 0;
-}
-
-static void usage(const char *argv0) {
-  fprintf(stderr, "Usage: %s [<higher magic>]\n", argv0);
-}
-
-static int init_opts(struct processor *this,
+static int init_opts(struct processor *this, struct options *opts,
 		     int argc, char **argv)
 {
   int opt;
+  long l;
+  char *e;
 
-  const char *shortopts = "-:hbdrut:w:i:o:";
+  const char *shortopts = "-:hbdru0f:n:j:t:w:i:o:D:";
 #ifdef USE_GETOPT_LONG
   const struct option longopts[] = {
     {"help", 0, NULL, 'h'},
-    {"body",       0, &processor->body,      1},
-    {"debug",      0, &processor->debug,      1},
-    {"rawtty",     0, &processor->rawtty,     1},
-    {"unbuffered", 0, &processor->unbuffered, 1},
+    {"body",       0, &this->body,       1},
+    {"debug",      0, &this->debug,      1},
+    {"rawtty",     0, &this->rawtty,     1},
+    {"unbuffered", 0, &this->unbuffered, 1},
+    {"flush",  1, NULL, 'f'},
+    {"depth",  1, NULL, 'n'},
+    {"jobs",   1, NULL, 'j'},
     {"term",   1, NULL, 't'},
     {"width",  1, NULL, 'w'},
     {"in",     1, NULL, 'i'},
     {"out",    1, NULL, 'o'},
+    {"serve",  1, NULL, OPT_SERVE},
+    {"batch",  1, NULL, OPT_BATCH},
+    {"compile", 0, NULL, OPT_COMPILE},
+    {"define", 1, NULL, 'D'},
+    {"template", 1, NULL, OPT_TEMPLATE},
+    {"stats",  2, NULL, OPT_STATS},
+    {"trace",  1, NULL, OPT_TRACE},
+    {"uring",  0, NULL, OPT_URING},
+    {"pipeline", 0, NULL, OPT_PIPELINE},
     {NULL,     0, NULL,  0 },
   };
 #endif
@@ -877,6 +195,33 @@ static int init_opts(struct processor *this,
       /* unbuffered mode */
       this->unbuffered = 1;
       break;
+    case 'f':
+      /* flush policy */
+      if(flush_decode(this, optarg)) {
+	fprintf(stderr, "Invalid flush policy: %s\n", optarg);
+	goto err;
+      }
+      break;
+
+    case 'n':
+      /* maximum nesting depth */
+      l = strtol(optarg, &e, 10);
+      if(e == optarg || *e || l < 1 || l > DEPTH_MAX) {
+	fprintf(stderr, "Invalid nesting depth: %s\n", optarg);
+	goto err;
+      }
+      this->attrmax = (int)l;
+      break;
+
+    case 'j':
+      /* batch worker threads */
+      l = strtol(optarg, &e, 10);
+      if(e == optarg || *e || l < 1 || l > BATCH_WORKERS) {
+	fprintf(stderr, "Invalid number of jobs: %s\n", optarg);
+	goto err;
+      }
+      opts->jobs = (int)l;
+      break;
 
     case 't':
       /* terminal type */
@@ -888,12 +233,92 @@ static int init_opts(struct processor *this,
       break;
 
     case 'i':
+      /* input files */
+      if(!opts->ifiles) {
+	opts->ifiles = calloc(argc, sizeof(char *));
+	if(!opts->ifiles) {
+	  goto err;
+	}
+      }
+      opts->ifiles[opts->nfiles++] = optarg;
       this->ifile = optarg;
       break;
+
+    case 'D':
+      /* template variables */
+      if(!opts->defines) {
+	opts->defines = calloc(argc, sizeof(char *));
+	if(!opts->defines) {
+	  goto err;
+	}
+      }
+      if(define_var(this, optarg, strlen(optarg))) {
+	goto err;
+      }
+      opts->defines[opts->ndefines++] = optarg;
+      break;
+    case OPT_TEMPLATE:
+      /* records provide variables */
+      opts->template = optarg;
+      break;
     case 'o':
       this->ofile = optarg;
       break;
 
+    case OPT_SERVE:
+      /* render daemon */
+      opts->serve = optarg;
+      break;
+
+    case OPT_COMPILE:
+      /* write compiled documents */
+      opts->compile = 1;
+      break;
+
+    case OPT_STATS:
+      /* statistics report */
+      if(!optarg || strcmp(optarg, "text") == 0) {
+	opts->stats = STATS_TEXT;
+      } else if(strcmp(optarg, "json") == 0) {
+	opts->stats = STATS_JSON;
+      } else {
+	fprintf(stderr, "Invalid statistics format: %s\n", optarg);
+	goto err;
+      }
+      this->timed = 1;
+      break;
+
+    case OPT_TRACE:
+      /* event trace */
+      opts->trace = optarg;
+      break;
+
+    case OPT_URING:
+      /* io_uring backend */
+      opts->uring = 1;
+      break;
+
+    case OPT_PIPELINE:
+      /* parse and render on separate threads */
+      opts->pipeline = 1;
+      break;
+
+    case '0':
+      /* NUL-delimited records */
+      opts->batch = BATCH_NUL;
+      break;
+    case OPT_BATCH:
+      /* record format */
+      if(strcmp(optarg, "nul") == 0) {
+	opts->batch = BATCH_NUL;
+      } else if(strcmp(optarg, "length") == 0) {
+	opts->batch = BATCH_LENGTH;
+      } else {
+	fprintf(stderr, "Invalid batch format: %s\n", optarg);
+	goto err;
+      }
+      break;
+
     default:
     case 'h':
     case ':':
@@ -904,93 +329,457 @@ static int init_opts(struct processor *this,
     }
   }
 
+  /* the pipeline parses one document, the other modes have their own
+     loops */
+  if(opts->pipeline && (opts->serve || opts->batch || opts->template
+			|| opts->compile || opts->nfiles > 1)) {
+    fprintf(stderr, "--pipeline only renders a single document\n");
+    goto err;
+  }
+
   return 0;
 
  err:
   return 1;
 }
 
-static int process_buf(struct processor *this, const char *buf, size_t len)
+struct tml_trace *trace_ring(void)
 {
-  enum XML_Status xs;
-  enum XML_Error xe;
-  xs = XML_Parse(this->xml, buf, len, 0);
-  if(xs != XML_STATUS_OK) {
-    xe = XML_GetErrorCode(this->xml);
-    fprintf(stderr, "XML error: %s\n", XML_ErrorString(xe));
-    goto err;
+  struct tml_trace *t;
+  if(!tracefile || ntraces == sizeof(traces) / sizeof(traces[0])) {
+    return NULL;
   }
-  return 0;
- err:
-  return 1;
+  t = processor_trace_new(TRACE_RECORDS);
+  if(t) {
+    traces[ntraces] = t;
+    ntraces++;
+  }
+  return t;
 }
 
-static int process_str(struct processor *this, const char *str)
+/* write all rings, using only calls that are safe in signal handlers */
+static int trace_dump(void)
 {
-  if(str) {
-    return process_buf(this, str, strlen(str));
-  } else {
-    return 0;
+  int fd, i, ret = 0;
+  fd = open(tracefile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if(fd == -1) {
+    return 1;
   }
+  for(i = 0; i < ntraces; i++) {
+    ret |= processor_trace_dump(traces[i], fd, i);
+  }
+  ret |= close(fd) == -1;
+  return ret;
 }
 
-static int process_end(struct processor *this)
+static void trace_signal(int sig)
 {
-  enum XML_Status xs;
-  enum XML_Error xe;
-  xs = XML_Parse(this->xml, NULL, 0, 1);
-  if(xs != XML_STATUS_OK) {
-    xe = XML_GetErrorCode(this->xml);
-    fprintf(stderr, "XML error: %s\n", XML_ErrorString(xe));
+  int saved = errno;
+  trace_dump();
+  errno = saved;
+}
+
+/* start tracing, dumping on SIGUSR1 */
+static int init_trace(struct processor *this, struct options *opts)
+{
+  struct sigaction sa;
+
+  if(!opts->trace) {
+    return 0;
+  }
+  tracefile = opts->trace;
+  this->trace = trace_ring();
+  if(!this->trace) {
+    fprintf(stderr, "Error allocating trace\n");
     return 1;
   }
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = trace_signal;
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGUSR1, &sa, NULL);
   return 0;
 }
 
+/* dump and release the traces */
+static int fini_trace(struct processor *this)
+{
+  int i, ret = 0;
+
+  if(!tracefile) {
+    return 0;
+  }
+  signal(SIGUSR1, SIG_IGN);
+  if(trace_dump()) {
+    perror(tracefile);
+    ret = 1;
+  }
+  for(i = 0; i < ntraces; i++) {
+    processor_trace_free(traces[i]);
+  }
+  ntraces = 0;
+  this->trace = NULL;
+  return ret;
+}
+
+ssize_t input_read(struct processor *this, int fd, char *buf, size_t len)
+{
+  struct pollfd pfd = { .fd = fd, .events = POLLIN };
+  ssize_t rd;
+  int res;
+
+  while(1) {
+    /* flush pending output if input stays idle, the emitter
+       thread does that itself */
+    if(this->flush == FLUSH_IDLE && !this->pipeline && this->olen) {
+      res = poll(&pfd, 1, this->flushidle);
+      if(res == 0) {
+	processor_flush(this);
+      }
+    }
+    /* nobody starts queued output while we sleep in read */
+    if(uring) {
+      uring_sync(this);
+    }
+    rd = read(fd, buf, len);
+    if(rd == -1) {
+      if(errno == EINTR) {
+	continue;
+      }
+      /* non-blocking input, sleep until it has data */
+      if(errno == EAGAIN || errno == EWOULDBLOCK) {
+	poll(&pfd, 1, -1);
+	continue;
+      }
+      perror("read");
+    }
+    return rd;
+  }
+}
+
+/* a non-blocking descriptor for the output FD, -1 if there is none */
+static int output_async(int fd)
+{
+  char path[64];
+  struct stat st;
+  int flags;
+
+  /* files never make us wait */
+  if(fstat(fd, &st) == -1 || S_ISREG(st.st_mode)) {
+    return -1;
+  }
+  flags = fcntl(fd, F_GETFL);
+  if(flags != -1 && (flags & O_NONBLOCK)) {
+    return fd;
+  }
+  /* open it again, so that the terminal or pipe stays blocking for
+     whoever shares it */
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+  return open(path, O_WRONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+}
+
+/* render FD as it arrives, without blocking on either side */
 static int process_fd(struct processor *this, int fd)
 {
-  int res, rd;
-  char buf[4096];
+  struct pollfd pfd[2];
+  char buf[INPUT_READ];
+  int ofd = this->ofd, afd, timeout, res, ret = 1;
+  ssize_t rd;
+
+  if(uring) {
+    return uring_process(this, fd);
+  }
+
+  /* output belongs to the emitter thread */
+  if(this->pipeline) {
+    while((rd = input_read(this, fd, buf, sizeof(buf))) > 0) {
+      if(processor_feed(this, buf, rd)) {
+	return 1;
+      }
+    }
+    return rd != 0;
+  }
+
+  /* queue output the terminal does not take yet */
+  afd = output_async(ofd);
+  if(afd != -1) {
+    this->ofd = afd;
+    this->oasync = 1;
+  }
 
   while(1) {
-    rd = read(0, buf, sizeof(buf));
+    /* read only while the queue has room */
+    pfd[0].fd = this->oqueued <= this->ocap / 2 ? fd : -1;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = this->oqueued ? this->ofd : -1;
+    pfd[1].events = POLLOUT;
+    /* flush pending output if input stays idle */
+    timeout = -1;
+    if(this->flush == FLUSH_IDLE && this->olen > this->oqueued) {
+      timeout = this->flushidle;
+    }
+    res = poll(pfd, 2, timeout);
+    if(res == -1) {
+      if(errno == EINTR) {
+	continue;
+      }
+      perror("poll");
+      goto out;
+    }
+    if(res == 0) {
+      processor_flush(this);
+      continue;
+    }
+    if(pfd[1].revents) {
+      processor_drain(this, 0);
+    }
+    if(!pfd[0].revents) {
+      continue;
+    }
+    rd = read(fd, buf, sizeof(buf));
     if(rd == -1) {
-      if(errno == EAGAIN) {
+      if(errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
 	continue;
       }
       perror("read");
-      goto err;
+      goto out;
     }
-    res = process_buf(this, buf, rd);
-    if(res) {
-      goto err;
+    if(processor_feed(this, buf, rd)) {
+      goto out;
     }
     if(rd == 0) {
       break;
     }
   }
 
+  ret = 0;
+
+ out:
+  /* the rest goes out as usual */
+  this->oasync = 0;
+  processor_drain(this, 1);
+  if(afd != -1 && afd != ofd) {
+    close(afd);
+  }
+  this->ofd = ofd;
+  return ret;
+}
+
+static int process_map(struct processor *this)
+{
+  size_t done = 0, n;
+  int res;
+
+  while(done < this->imaplen) {
+    n = this->imaplen - done;
+    if(n > INPUT_SLICE) {
+      n = INPUT_SLICE;
+    }
+    res = processor_feed(this, this->imap + done, n);
+    if(res) {
+      return 1;
+    }
+    done += n;
+  }
+
   return 0;
+}
 
- err:
-  return 1;
+int init_input(struct processor *this)
+{
+  struct stat st;
+  void *map;
+
+  if(!this->ifile) {
+    return 0;
+  }
+
+  this->ifd = open(this->ifile, O_RDONLY);
+  if(this->ifd == -1) {
+    perror(this->ifile);
+    return 1;
+  }
+
+  /* map regular files, read anything else */
+  if(fstat(this->ifd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, this->ifd, 0);
+    if(map != MAP_FAILED) {
+      madvise(map, st.st_size, MADV_SEQUENTIAL);
+      this->imap = map;
+      this->imaplen = st.st_size;
+    }
+  }
+
+  return 0;
+}
+
+int fini_input(struct processor *this)
+{
+  if(this->imap) {
+    munmap((void *)this->imap, this->imaplen);
+    this->imap = NULL;
+    this->imaplen = 0;
+  }
+  if(this->ifile && this->ifd != -1) {
+    close(this->ifd);
+    this->ifd = -1;
+  }
+  return 0;
+}
+
+/* compile the whole input and write out the result */
+static int process_compile(struct processor *this)
+{
+  struct tml_buffer in, out;
+  const char *buf;
+  size_t len;
+  ssize_t rd;
+  char *n;
+  int ret = 1;
+
+  memset(&in, 0, sizeof(in));
+  memset(&out, 0, sizeof(out));
+  out.grow = 1;
+
+  /* the compiler needs the document in one piece */
+  if(this->expression) {
+    buf = this->expression;
+    len = strlen(buf);
+  } else if(this->imap) {
+    buf = this->imap;
+    len = this->imaplen;
+  } else {
+    do {
+      if(in.cap - in.len < 65536) {
+	n = realloc(in.data, in.cap + 65536);
+	if(!n) {
+	  perror("realloc");
+	  goto out;
+	}
+	in.data = n;
+	in.cap += 65536;
+      }
+      rd = input_read(this, this->ifd, in.data + in.len, in.cap - in.len);
+      if(rd == -1) {
+	goto out;
+      }
+      in.len += rd;
+    } while(rd);
+    buf = in.data;
+    len = in.len;
+  }
+
+  if(processor_compile(this, buf, len, &out) != TML_OK) {
+    goto out;
+  }
+  processor_write(this, out.data, out.len);
+  processor_sync(this, FLUSH_DOCUMENT);
+
+  ret = 0;
+
+ out:
+  free(in.data);
+  free(out.data);
+  return ret;
+}
+
+static int init_ofile(struct processor *this)
+{
+  if(!this->ofile) {
+    return 0;
+  }
+
+  this->ofd = open(this->ofile, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if(this->ofd == -1) {
+    perror(this->ofile);
+    return 1;
+  }
+
+  return 0;
 }
 
-static int processor_init(struct processor *this) {
-  bzero(this, sizeof(*this));
-  this->term = getenv("TERM");
-  this->termw = -1;
-  this->ifd = 0;
-  this->is = NULL;
-  this->ofd = 1;
-  this->os = NULL;
-  this->ow = -1;
+static int fini_ofile(struct processor *this)
+{
+  if(this->ofile && this->ofd != -1) {
+    if(close(this->ofd) == -1) {
+      perror(this->ofile);
+      return 1;
+    }
+    this->ofd = -1;
+  }
   return 0;
 }
 
+static double seconds(uint64_t ns)
+{
+  return ns / 1e9;
+}
+
+/* report statistics on stderr */
+static void stats_print(struct processor *this, struct options *opts,
+			uint64_t wall)
+{
+  struct tml_stats *s = &this->stats;
+
+  if(opts->stats == STATS_JSON) {
+    fprintf(stderr,
+	    "{\"documents\":%llu,\"input_bytes\":%llu,"
+	    "\"output_bytes\":%llu,\"escape_bytes\":%llu,"
+	    "\"writes\":%llu,\"tiparms\":%llu,\"elements\":%llu,"
+	    "\"max_depth\":%llu,\"lines\":%llu,\"wrapped_lines\":%llu,"
+	    "\"parse_s\":%.6f,\"emit_s\":%.6f,\"flush_s\":%.6f,"
+	    "\"total_s\":%.6f}\n",
+	    (unsigned long long)s->documents,
+	    (unsigned long long)s->ibytes,
+	    (unsigned long long)s->obytes,
+	    (unsigned long long)s->escbytes,
+	    (unsigned long long)s->writes,
+	    (unsigned long long)s->tiparms,
+	    (unsigned long long)s->elements,
+	    (unsigned long long)s->depth,
+	    (unsigned long long)s->newlines,
+	    (unsigned long long)s->wraps,
+	    seconds(s->ns[PHASE_PARSE]), seconds(s->ns[PHASE_EMIT]),
+	    seconds(s->ns[PHASE_FLUSH]), seconds(wall));
+    return;
+  }
+
+  fprintf(stderr, "documents      %llu\n", (unsigned long long)s->documents);
+  fprintf(stderr, "input bytes    %llu\n", (unsigned long long)s->ibytes);
+  fprintf(stderr, "output bytes   %llu\n", (unsigned long long)s->obytes);
+  fprintf(stderr, "escape bytes   %llu\n", (unsigned long long)s->escbytes);
+  fprintf(stderr, "write calls    %llu\n", (unsigned long long)s->writes);
+  fprintf(stderr, "tiparm calls   %llu\n", (unsigned long long)s->tiparms);
+  fprintf(stderr, "elements       %llu\n", (unsigned long long)s->elements);
+  fprintf(stderr, "max depth      %llu\n", (unsigned long long)s->depth);
+  fprintf(stderr, "lines          %llu\n", (unsigned long long)s->newlines);
+  fprintf(stderr, "wrapped lines  %llu\n", (unsigned long long)s->wraps);
+  fprintf(stderr, "parse time     %.6f s\n", seconds(s->ns[PHASE_PARSE]));
+  fprintf(stderr, "emit time      %.6f s\n", seconds(s->ns[PHASE_EMIT]));
+  fprintf(stderr, "flush time     %.6f s\n", seconds(s->ns[PHASE_FLUSH]));
+  fprintf(stderr, "total time     %.6f s\n", seconds(wall));
+}
+
+static uint64_t wall_clock(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int process_str(struct processor *this, const char *str)
+{
+  if(str) {
+    return processor_feed(this, str, strlen(str));
+  } else {
+    return 0;
+  }
+}
+
 static int processor_run(struct processor *this, int argc, char **argv) {
+  struct options opts;
+  uint64_t start = wall_clock();
   int res, ret = 1;
-  struct attributes *iattr;
 
   /* initialize state */
   res = processor_init(this);
@@ -999,106 +788,147 @@ static int processor_run(struct processor *this, int argc, char **argv) {
   }
 
   /* parse options */
-  res = init_opts(this, argc, argv);
+  memset(&opts, 0, sizeof(opts));
+  res = init_opts(this, &opts, argc, argv);
   if(res) {
     goto err_init_opts;
   }
 
-  /* initialize xml parser */
-  res = init_xml(this);
+  /* start tracing */
+  res = init_trace(this, &opts);
   if(res) {
-    fprintf(stderr, "Error in XML setup\n");
-    goto err_init_xml;
+    goto err_init_trace;
+  }
+
+  /* render daemon */
+  if(opts.serve) {
+    ret = serve_run(this, &opts);
+    if(opts.stats) {
+      stats_print(this, &opts, wall_clock() - start);
+    }
+    goto err_init_input;
+  }
+
+  /* batches handle their own input */
+  if(opts.batch || opts.template || opts.nfiles > 1) {
+    this->ifile = NULL;
+  }
+
+  /* expressions are body text */
+  if(this->expression) {
+    this->body = 1;
   }
 
-  /* initialize terminal */
-  res = init_term(this);
+  /* open input file */
+  res = init_input(this);
   if(res) {
-    fprintf(stderr, "Error in terminal setup\n");
-    goto err_init_term;
+    goto err_init_input;
   }
 
-  /* tweak terminal size for non-raw mode */
-  if((isatty(this->ofd) == 1) && !this->rawtty) {
-    this->termw -= 1;
+  /* open output file */
+  res = init_ofile(this);
+  if(res) {
+    goto err_init_ofile;
   }
 
-  if(this->debug)
-    fprintf(stderr, "Terminal type: %s\n", this->term);
-  if(this->debug)
-    fprintf(stderr, "Terminal width: %d\n", this->termw);
+  /* set up output, parser and terminal */
+  res = processor_setup(this);
+  if(res) {
+    goto err_setup;
+  }
 
-  /* determine output width */
-  if(this->ow <= 0) {
-    this->ow = this->termw;
+  /* asynchronous I/O, if the kernel has it, but not from a thread
+     that has no chance to start what it queued before it sleeps */
+  if(opts.uring && !opts.pipeline) {
+    uring = !uring_init(this);
+    if(!uring && this->debug) {
+      fprintf(stderr, "io_uring unavailable, using read and write\n");
+    }
   }
-  if(this->ow <= 0) {
-    this->ow = 80;
+
+  /* write bytecode instead of rendering */
+  if(opts.compile) {
+    ret = process_compile(this);
+    goto err_process;
   }
 
-  if(this->debug)
-    fprintf(stderr, "Output width: %d\n", this->ow);
+  /* render records */
+  if(opts.batch || opts.template || opts.nfiles > 1) {
+    ret = batch_run(this, &opts);
+    goto err_process;
+  }
 
-  /* prepare initial attributes */
-  iattr = attr_push(this);
-  iattr->fg = COLOR_DEFAULT;
-  iattr->bg = COLOR_DEFAULT;
+  /* compiled documents skip the parser */
+  if(this->imap && processor_compiled(this->imap, this->imaplen)) {
+    ret = processor_exec(this, this->imap, this->imaplen);
+    goto err_process;
+  }
 
-  /* perform processing */
-  if(this->expression || this->body) {
-    res = process_str(this, "<tml>");
+  /* render on a second thread */
+  if(opts.pipeline) {
+    res = processor_pipeline_start(this);
     if(res) {
       goto err_process;
     }
   }
+
+  /* perform processing */
+  res = processor_begin(this);
+  if(res) {
+    goto err_process;
+  }
   if(this->expression) {
     res = process_str(this, this->expression);
     if(res) {
       goto err_process;
     }
-  } else {
-    res = process_fd(this, this->ifd);
+  } else if(this->imap) {
+    res = process_map(this);
     if(res) {
       goto err_process;
     }
-  }
-  if(this->expression || this->body) {
-    res = process_str(this, "</tml>");
+  } else {
+    res = process_fd(this, this->ifd);
     if(res) {
       goto err_process;
     }
   }
-  res = process_end(this);
+  res = processor_end(this);
   if(res) {
     goto err_process;
   }
 
-  /* finish attributes */
-  attr_pop(this);
-
-  /* emit final newline */
-  if(this->oc > 0) {
-    emit_newline(this);
-  }
-
-  /* flush output */
-  emit_flush(this);
-
   /* done */
   ret = 0;
 
  err_process:
-  res = fini_term(this);
+  /* renders what the parser queued */
+  processor_pipeline_stop(this);
+  /* includes the final flush, but not teardown */
+  if(opts.stats) {
+    stats_print(this, &opts, wall_clock() - start);
+  }
+  uring_fini(this);
+  res = processor_fini(this);
+ err_setup:
+  res = fini_ofile(this);
+  if(res) {
+    ret = 1;
+  }
+ err_init_ofile:
+  res = fini_input(this);
   if(res) {
-    fprintf(stderr, "Error finalizing terminal\n");
+    fprintf(stderr, "Error finalizing input\n");
   }
- err_init_term:
-  res = fini_xml(this);
+ err_init_input:
+  res = fini_trace(this);
   if(res) {
-    fprintf(stderr, "Error finalizing parser\n");
+    ret = 1;
   }
- err_init_xml:
+ err_init_trace:
  err_init_opts:
+  free(opts.ifiles);
+  free(opts.defines);
  err_init:
 
   return ret;
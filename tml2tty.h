@@ -0,0 +1,83 @@
+/*
+ * tml2tty - command line front end of libtml
+ */
+
+#ifndef TML2TTY_H
+#define TML2TTY_H
+
+#include <sys/types.h>
+
+#include "tml.h"
+
+/* batch record formats */
+#define BATCH_NONE   0
+#define BATCH_NUL    1
+#define BATCH_LENGTH 2
+
+/* most batch worker threads */
+#define BATCH_WORKERS 256
+
+/* options that only concern the program */
+struct options {
+  /* socket to serve renders on */
+  char *serve;
+  /* batch record format */
+  int batch;
+  /* worker threads for batches */
+  int jobs;
+  /* write compiled documents */
+  int compile;
+  /* input files */
+  char **ifiles;
+  int nfiles;
+  /* variable definitions */
+  char **defines;
+  int ndefines;
+  /* template rendered with variables from each record */
+  char *template;
+  /* report statistics at exit */
+  int stats;
+  /* file to dump traces to */
+  char *trace;
+  /* use io_uring when available */
+  int uring;
+  /* parse and render on separate threads */
+  int pipeline;
+};
+
+/* statistics report formats */
+#define STATS_TEXT 1
+#define STATS_JSON 2
+
+/* open and map the input file */
+int init_input(struct processor *this);
+int fini_input(struct processor *this);
+/* read input, flushing output while idle */
+ssize_t input_read(struct processor *this, int fd, char *buf, size_t len);
+
+/* another trace ring dumped with the others, NULL if not tracing */
+struct tml_trace *trace_ring(void);
+
+/* prepare a processor that renders into memory with the settings of
+   FROM, before it is set up */
+void init_renderer(struct processor *this, const struct processor *from);
+
+/* set a template variable from NAME=VALUE */
+int define_var(struct processor *this, const char *def, size_t len);
+
+/* serve renders on a unix socket until interrupted */
+int serve_run(struct processor *this, struct options *opts);
+
+/* render independent records */
+int batch_run(struct processor *this, struct options *opts);
+
+/* route output through io_uring, 1 if the kernel does not offer it */
+int uring_init(struct processor *this);
+/* wait for the output and go back to plain writes */
+void uring_fini(struct processor *this);
+/* start all queued output, before waiting for something else */
+void uring_sync(struct processor *this);
+/* render FD with reads through io_uring */
+int uring_process(struct processor *this, int fd);
+
+#endif /* TML2TTY_H */
@@ -0,0 +1,154 @@
+/*
+ * tmltrace - print the timeline of a trace dumped by tml2tty --trace
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tml.h"
+
+static const char *event_names[] = {
+  [TRACE_START] = "start",
+  [TRACE_END] = "end",
+  [TRACE_CDATA] = "cdata",
+  [TRACE_SWITCH] = "switch",
+  [TRACE_EMIT] = "emit",
+};
+
+/* read all of F */
+static char *slurp(FILE *f, size_t *len)
+{
+  size_t cap = 65536, n;
+  char *buf = malloc(cap), *nb;
+
+  *len = 0;
+  while(buf) {
+    n = fread(buf + *len, 1, cap - *len, f);
+    *len += n;
+    if(*len < cap) {
+      break;
+    }
+    cap *= 2;
+    nb = realloc(buf, cap);
+    if(!nb) {
+      free(buf);
+      return NULL;
+    }
+    buf = nb;
+  }
+  return buf;
+}
+
+/* name of element ID from the NUL separated NAMES */
+static const char *element_name(const char *names, size_t len, int id)
+{
+  size_t i = 0;
+  while(i < len) {
+    if(id-- == 0) {
+      return names + i;
+    }
+    i += strnlen(names + i, len - i) + 1;
+  }
+  return "?";
+}
+
+/* print one ring, returns its size or 0 if it is damaged */
+static size_t print_ring(const char *p, size_t len)
+{
+  struct tml_trace_header h;
+  struct tml_trace_rec r;
+  const char *names, *recs;
+  double scale, start = 0, prev = 0, t;
+  uint64_t i;
+
+  if(len < sizeof(h)) {
+    return 0;
+  }
+  memcpy(&h, p, sizeof(h));
+  if(memcmp(h.magic, TRACE_MAGIC, 4) != 0 || h.version != TRACE_VERSION
+     || h.namelen > len - sizeof(h)
+     || h.nrecs > (len - sizeof(h) - h.namelen) / sizeof(r)) {
+    return 0;
+  }
+  names = p + sizeof(h);
+  recs = names + h.namelen;
+
+  /* timestamps are counter ticks, scaled by the readings taken
+     when the ring was created and when it was dumped */
+  scale = h.tsc1 > h.tsc0 ? (double)(h.ns1 - h.ns0) / (h.tsc1 - h.tsc0) : 1;
+
+  printf("ring %u: %llu records, %llu lost\n", h.ring,
+	 (unsigned long long)h.nrecs, (unsigned long long)h.lost);
+  printf("%12s %10s  %-7s %-9s %s\n", "usec", "+usec", "event", "element",
+	 "detail");
+  for(i = 0; i < h.nrecs; i++) {
+    memcpy(&r, recs + i * sizeof(r), sizeof(r));
+    t = (double)(int64_t)(r.time - h.tsc0) * scale / 1000;
+    if(i == 0) {
+      start = prev = t;
+    }
+    printf("%12.3f %10.3f  %-7s ", t - start, t - prev,
+	   r.type < sizeof(event_names) / sizeof(event_names[0])
+	   ? event_names[r.type] : "?");
+    prev = t;
+    switch(r.type) {
+    case TRACE_START:
+    case TRACE_END:
+      printf("%-9s in %u\n", element_name(names, h.namelen, r.id), r.off);
+      break;
+    case TRACE_CDATA:
+      printf("%-9s in %u, %u bytes\n", "", r.off, r.len);
+      break;
+    case TRACE_SWITCH:
+      printf("%-9s style 0x%08x, %u bytes\n", "", r.off, r.len);
+      break;
+    case TRACE_EMIT:
+      printf("%-9s out %u, %u bytes\n", "", r.off, r.len);
+      break;
+    default:
+      printf("\n");
+      break;
+    }
+  }
+
+  return sizeof(h) + h.namelen + h.nrecs * sizeof(r);
+}
+
+int main(int argc, char **argv)
+{
+  FILE *f = stdin;
+  size_t len, off = 0, n;
+  char *buf;
+
+  if(argc > 2) {
+    fprintf(stderr, "Usage: %s [<trace>]\n", argv[0]);
+    return 1;
+  }
+  if(argc == 2) {
+    f = fopen(argv[1], "rb");
+    if(!f) {
+      perror(argv[1]);
+      return 1;
+    }
+  }
+
+  buf = slurp(f, &len);
+  if(!buf) {
+    perror("read");
+    return 1;
+  }
+
+  while(off < len) {
+    n = print_ring(buf + off, len - off);
+    if(!n) {
+      fprintf(stderr, "Damaged trace at byte %zu\n", off);
+      free(buf);
+      return 1;
+    }
+    off += n;
+  }
+
+  free(buf);
+  return 0;
+}
@@ -0,0 +1,595 @@
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "tml2tty.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_URING 1
+#endif
+#endif
+
+#ifdef HAVE_URING
+
+#include <linux/io_uring.h>
+
+/* buffers kept in flight for each direction */
+#define URING_READS 4
+#define URING_WRITES 4
+#define URING_SLOTS (URING_READS + URING_WRITES)
+/* size of each registered buffer */
+#define URING_SLOT 65536
+/* queue entries, with room for a poll before every request */
+#define URING_ENTRIES 16
+/* user data of polls, whose completions are ignored */
+#define URING_POLL 0xffffffffULL
+
+/* states of a buffer */
+#define SLOT_FREE   0
+/* written to, not submitted yet */
+#define SLOT_QUEUED 1
+/* owned by the kernel */
+#define SLOT_BUSY   2
+/* completed, result not used yet */
+#define SLOT_DONE   3
+
+/* a registered buffer, slots for reads come first */
+struct uring_slot {
+  char *data;
+  int state;
+  /* bytes to transfer, and those done */
+  size_t len;
+  size_t done;
+  /* file offset, for seekable files */
+  uint64_t off;
+  /* result of a read */
+  int res;
+};
+
+struct uring {
+  /* handed to the processor, must come first */
+  struct tml_writer writer;
+  struct processor *proc;
+  int fd;
+  /* submission queue */
+  void *sqmap;
+  size_t sqlen;
+  unsigned *sqhead;
+  unsigned *sqtail;
+  unsigned *sqmask;
+  unsigned *sqarray;
+  struct io_uring_sqe *sqes;
+  size_t sqeslen;
+  unsigned submit;
+  /* completion queue, shares the mapping */
+  unsigned *cqhead;
+  unsigned *cqtail;
+  unsigned *cqmask;
+  struct io_uring_cqe *cqes;
+  /* registered buffers */
+  char *mem;
+  struct uring_slot slots[URING_SLOTS];
+
+  /* input: reads in order, starting at slot rhead */
+  int ifd;
+  int iseek;
+  int ieof;
+  int rhead;
+  int rcount;
+  int rbusy;
+  /* offsets of the next read and of the next parsed byte */
+  uint64_t ipos;
+  uint64_t iparse;
+
+  /* output: writes in order, starting at slot whead */
+  int ofd;
+  int oseek;
+  int whead;
+  int wcount;
+  int wbusy;
+  uint64_t opos;
+};
+
+/* the ring of this program, NULL when using plain I/O */
+static struct uring *ring;
+
+static int sys_setup(unsigned entries, struct io_uring_params *p)
+{
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned submit, unsigned wait, unsigned flags)
+{
+  return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned op, void *arg, unsigned n)
+{
+  return syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+/* files whose offsets we can manage ourselves */
+static int fd_seekable(int fd, off_t *pos)
+{
+  struct stat st;
+  int flags = fcntl(fd, F_GETFL);
+
+  if(fstat(fd, &st) == -1 || flags == -1 || (flags & O_APPEND)) {
+    return 0;
+  }
+  if(!S_ISREG(st.st_mode) && !S_ISBLK(st.st_mode)) {
+    return 0;
+  }
+  *pos = lseek(fd, 0, SEEK_CUR);
+  return *pos != -1;
+}
+
+/* next free submission entry, queued with the next enter */
+static struct io_uring_sqe *uring_sqe(struct uring *u)
+{
+  unsigned tail = *u->sqtail, idx = tail & *u->sqmask;
+  struct io_uring_sqe *sqe = &u->sqes[idx];
+
+  memset(sqe, 0, sizeof(*sqe));
+  u->sqarray[idx] = idx;
+  __atomic_store_n(u->sqtail, tail + 1, __ATOMIC_RELEASE);
+  u->submit++;
+  return sqe;
+}
+
+/* transfer slot I, after waiting for FD to become ready if POLL */
+static void uring_rw(struct uring *u, int i, int poll)
+{
+  struct uring_slot *s = &u->slots[i];
+  struct io_uring_sqe *sqe;
+  int read = i < URING_READS;
+  int fd = read ? u->ifd : u->ofd;
+
+  /* non-blocking descriptors answer EAGAIN instead of waiting */
+  if(poll) {
+    sqe = uring_sqe(u);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll_events = read ? POLLIN : POLLOUT;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = URING_POLL;
+  }
+
+  sqe = uring_sqe(u);
+  sqe->opcode = read ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t)(s->data + s->done);
+  sqe->len = s->len - s->done;
+  /* streams continue at their current position */
+  sqe->off = (read ? u->iseek : u->oseek) ? s->off + s->done : (uint64_t)-1;
+  sqe->buf_index = i;
+  sqe->user_data = i;
+  s->state = SLOT_BUSY;
+}
+
+/* start writes that are ready. streams take one at a time, files
+   also take full buffers while others are in flight. the rest
+   gathers more output until then. */
+static void uring_wpush(struct uring *u)
+{
+  struct uring_slot *s;
+  int n, i;
+
+  for(n = 0; n < u->wcount; n++) {
+    i = URING_READS + (u->whead + n) % URING_WRITES;
+    s = &u->slots[i];
+    if(s->state != SLOT_QUEUED) {
+      continue;
+    }
+    if(u->wbusy && (!u->oseek || s->len < URING_SLOT)) {
+      break;
+    }
+    s->off = u->opos;
+    u->opos += s->len;
+    u->wbusy++;
+    uring_rw(u, i, 0);
+  }
+}
+
+/* start reads into free buffers, only one at a time on streams */
+static void uring_rpush(struct uring *u)
+{
+  struct uring_slot *s;
+  int i;
+
+  while(u->rcount < URING_READS && !u->ieof && (u->iseek || !u->rbusy)) {
+    i = (u->rhead + u->rcount) % URING_READS;
+    s = &u->slots[i];
+    s->len = URING_SLOT;
+    s->done = 0;
+    s->off = u->ipos;
+    if(u->iseek) {
+      u->ipos += URING_SLOT;
+    }
+    u->rcount++;
+    u->rbusy++;
+    uring_rw(u, i, 0);
+  }
+}
+
+/* handle the completion of slot I */
+static void uring_complete(struct uring *u, int i, int res)
+{
+  struct uring_slot *s = &u->slots[i];
+
+  if(res == -EAGAIN || res == -EINTR) {
+    uring_rw(u, i, res == -EAGAIN);
+    return;
+  }
+
+  /* reads are looked at in order by uring_process */
+  if(i < URING_READS) {
+    s->res = res;
+    s->state = SLOT_DONE;
+    u->rbusy--;
+    return;
+  }
+
+  if(res < 0) {
+    errno = -res;
+    perror("write");
+    exit(1);
+  }
+  /* short writes continue where they stopped */
+  s->done += res;
+  if(s->done < s->len) {
+    uring_rw(u, i, 0);
+    return;
+  }
+  s->state = SLOT_DONE;
+  u->wbusy--;
+
+  /* release finished buffers in order */
+  while(u->wcount) {
+    s = &u->slots[URING_READS + u->whead];
+    if(s->state != SLOT_DONE) {
+      break;
+    }
+    s->state = SLOT_FREE;
+    u->whead = (u->whead + 1) % URING_WRITES;
+    u->wcount--;
+  }
+  uring_wpush(u);
+}
+
+/* submit what is queued and, if WAIT, wait for a completion */
+static void uring_enter(struct uring *u, int wait)
+{
+  struct io_uring_cqe *cqe;
+  unsigned head, tail;
+  uint64_t data;
+  int res;
+
+  do {
+    /* completions are reaped from shared memory, the kernel is only
+       entered to submit or sleep */
+    if(u->submit || wait) {
+      res = sys_enter(u->fd, u->submit, wait ? 1 : 0,
+		      wait ? IORING_ENTER_GETEVENTS : 0);
+      if(res == -1) {
+	if(errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+	  perror("io_uring_enter");
+	  exit(1);
+	}
+	continue;
+      }
+      u->submit -= res;
+      wait = 0;
+    }
+
+    head = *u->cqhead;
+    tail = __atomic_load_n(u->cqtail, __ATOMIC_ACQUIRE);
+    while(head != tail) {
+      cqe = &u->cqes[head & *u->cqmask];
+      data = cqe->user_data;
+      res = cqe->res;
+      __atomic_store_n(u->cqhead, ++head, __ATOMIC_RELEASE);
+      /* completions may queue more requests */
+      if(data != URING_POLL) {
+	uring_complete(u, data, res);
+      }
+      tail = __atomic_load_n(u->cqtail, __ATOMIC_ACQUIRE);
+    }
+  } while(wait || u->submit);
+}
+
+/* copy output into buffers, waiting for one when all are in flight */
+static size_t uring_write(struct tml_writer *w, const char *buf, size_t len,
+			  int block)
+{
+  struct uring *u = (struct uring *)w;
+  struct uring_slot *s = NULL;
+  size_t n, done = 0;
+
+  while(done < len) {
+    /* add to the last buffer if it has not been started yet */
+    if(u->wcount) {
+      s = &u->slots[URING_READS + (u->whead + u->wcount - 1) % URING_WRITES];
+      if(s->state != SLOT_QUEUED || s->len == URING_SLOT) {
+	s = NULL;
+      }
+    }
+    if(!s && u->wcount < URING_WRITES) {
+      s = &u->slots[URING_READS + (u->whead + u->wcount) % URING_WRITES];
+      s->state = SLOT_QUEUED;
+      s->len = 0;
+      s->done = 0;
+      u->wcount++;
+    }
+    if(!s) {
+      uring_wpush(u);
+      uring_enter(u, 1);
+      continue;
+    }
+    n = URING_SLOT - s->len;
+    if(n > len - done) {
+      n = len - done;
+    }
+    memcpy(s->data + s->len, buf + done, n);
+    s->len += n;
+    done += n;
+    s = NULL;
+  }
+
+  uring_wpush(u);
+  uring_enter(u, 0);
+  return done;
+}
+
+void uring_sync(struct processor *this)
+{
+  struct uring *u = ring;
+  int n;
+
+  if(!u) {
+    return;
+  }
+  /* until the last buffer has been started */
+  while(u->wcount) {
+    n = (u->whead + u->wcount - 1) % URING_WRITES;
+    if(u->slots[URING_READS + n].state != SLOT_QUEUED) {
+      break;
+    }
+    uring_wpush(u);
+    uring_enter(u, u->slots[URING_READS + n].state == SLOT_QUEUED);
+  }
+}
+
+int uring_process(struct processor *this, int fd)
+{
+  struct uring *u = ring;
+  struct uring_slot *s;
+  struct pollfd pfd;
+  off_t pos = 0;
+  int res, ret = 1;
+
+  u->ifd = fd;
+  u->iseek = fd_seekable(fd, &pos);
+  u->ipos = u->iparse = pos;
+  u->ieof = 0;
+
+  while(1) {
+    uring_rpush(u);
+    uring_enter(u, 0);
+    s = &u->slots[u->rhead];
+    while(s->state != SLOT_DONE) {
+      /* flush pending output if input stays idle, the ring polls
+	 readable while it has completions */
+      if(this->flush == FLUSH_IDLE && this->olen) {
+	pfd.fd = u->fd;
+	pfd.events = POLLIN;
+	if(poll(&pfd, 1, this->flushidle) == 0) {
+	  processor_flush(this);
+	}
+      }
+      uring_enter(u, 1);
+    }
+    res = s->res;
+    if(res < 0) {
+      errno = -res;
+      perror("read");
+      goto out;
+    }
+
+    /* reads started past a short one are repeated */
+    if(u->iseek && s->off != u->iparse) {
+      s->state = SLOT_FREE;
+      u->rhead = (u->rhead + 1) % URING_READS;
+      u->rcount--;
+      continue;
+    }
+    if(u->iseek) {
+      u->iparse += res;
+      if((size_t)res < s->len) {
+	u->ipos = u->iparse;
+      }
+    }
+    if(res == 0) {
+      u->ieof = 1;
+    }
+
+    /* the next reads run while this one is parsed */
+    uring_rpush(u);
+    uring_enter(u, 0);
+    if(processor_feed(this, s->data, res)) {
+      goto out;
+    }
+    s->state = SLOT_FREE;
+    u->rhead = (u->rhead + 1) % URING_READS;
+    u->rcount--;
+    if(res == 0) {
+      break;
+    }
+  }
+
+  ret = 0;
+
+ out:
+  /* wait for reads still in flight, and leave the file where plain
+     reads would have */
+  while(u->rbusy) {
+    uring_enter(u, 1);
+  }
+  u->rhead = u->rcount = 0;
+  if(u->iseek) {
+    lseek(fd, u->iparse, SEEK_SET);
+  }
+  return ret;
+}
+
+int uring_init(struct processor *this)
+{
+  struct io_uring_params p;
+  struct iovec iov[URING_SLOTS];
+  struct uring *u;
+  size_t cqlen;
+  off_t pos = 0;
+  int i;
+
+  u = calloc(1, sizeof(*u));
+  if(!u) {
+    return 1;
+  }
+
+  memset(&p, 0, sizeof(p));
+  u->fd = sys_setup(URING_ENTRIES, &p);
+  if(u->fd == -1) {
+    goto err_setup;
+  }
+  /* current positions on streams arrived together with plain reads
+     and writes, so older kernels use the plain path */
+  if(!(p.features & IORING_FEAT_SINGLE_MMAP)
+     || !(p.features & IORING_FEAT_RW_CUR_POS)) {
+    goto err_map;
+  }
+
+  /* both queues share one mapping */
+  u->sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if(cqlen > u->sqlen) {
+    u->sqlen = cqlen;
+  }
+  u->sqmap = mmap(NULL, u->sqlen, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+  if(u->sqmap == MAP_FAILED) {
+    goto err_map;
+  }
+  u->sqeslen = p.sq_entries * sizeof(struct io_uring_sqe);
+  u->sqes = mmap(NULL, u->sqeslen, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+  if(u->sqes == MAP_FAILED) {
+    goto err_sqes;
+  }
+  u->sqhead = (unsigned *)((char *)u->sqmap + p.sq_off.head);
+  u->sqtail = (unsigned *)((char *)u->sqmap + p.sq_off.tail);
+  u->sqmask = (unsigned *)((char *)u->sqmap + p.sq_off.ring_mask);
+  u->sqarray = (unsigned *)((char *)u->sqmap + p.sq_off.array);
+  u->cqhead = (unsigned *)((char *)u->sqmap + p.cq_off.head);
+  u->cqtail = (unsigned *)((char *)u->sqmap + p.cq_off.tail);
+  u->cqmask = (unsigned *)((char *)u->sqmap + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *)((char *)u->sqmap + p.cq_off.cqes);
+
+  /* buffers are registered once, sparing the kernel a page walk
+     for every request */
+  u->mem = mmap(NULL, URING_SLOTS * URING_SLOT, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(u->mem == MAP_FAILED) {
+    goto err_mem;
+  }
+  for(i = 0; i < URING_SLOTS; i++) {
+    u->slots[i].data = u->mem + i * URING_SLOT;
+    iov[i].iov_base = u->slots[i].data;
+    iov[i].iov_len = URING_SLOT;
+  }
+  if(sys_register(u->fd, IORING_REGISTER_BUFFERS, iov, URING_SLOTS) == -1) {
+    goto err_register;
+  }
+
+  u->proc = this;
+  u->ofd = this->ofd;
+  u->oseek = fd_seekable(this->ofd, &pos);
+  u->opos = pos;
+  u->writer.write = uring_write;
+  this->writer = &u->writer;
+  ring = u;
+  return 0;
+
+ err_register:
+  munmap(u->mem, URING_SLOTS * URING_SLOT);
+ err_mem:
+  munmap(u->sqes, u->sqeslen);
+ err_sqes:
+  munmap(u->sqmap, u->sqlen);
+ err_map:
+  close(u->fd);
+ err_setup:
+  free(u);
+  return 1;
+}
+
+void uring_fini(struct processor *this)
+{
+  struct uring *u = ring;
+
+  if(!u) {
+    return;
+  }
+
+  /* wait for the output */
+  uring_wpush(u);
+  while(u->wcount) {
+    uring_enter(u, 1);
+  }
+  if(u->oseek) {
+    lseek(u->ofd, u->opos, SEEK_SET);
+  }
+  if(this->writer == &u->writer) {
+    this->writer = NULL;
+  }
+
+  close(u->fd);
+  munmap(u->mem, URING_SLOTS * URING_SLOT);
+  munmap(u->sqes, u->sqeslen);
+  munmap(u->sqmap, u->sqlen);
+  free(u);
+  ring = NULL;
+}
+
+#else /* !HAVE_URING */
+
+void uring_sync(struct processor *this)
+{
+}
+
+int uring_process(struct processor *this, int fd)
+{
+  return 1;
+}
+
+int uring_init(struct processor *this)
+{
+  return 1;
+}
+
+void uring_fini(struct processor *this)
+{
+}
+
+#endif /* !HAVE_URING */